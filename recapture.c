@@ -19,21 +19,66 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sndfile.h>
 #include <math.h>
+#include <complex.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <getopt.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
 
 // Standard includes plus sndfile.h, jack/jack.h and jack/ringbuffer.h. jack.h contains the general API and ringbuffer.h contains jack's implementation of a circular buffer. libsndfile is used for reading and writing audio data.
 
 const char* usage =
- "usage: recapture [ -b bufsize ] [ -i <inports> ] [ -o <outports> ] infile outfile\n"
- "            <inports> and <outports> are `,' separated\n";
+ "usage: recapture [ -b bufsize ] [ -w percent ] [ -S usecs ] [ -p ms ] [ -L ] [ -T ms ] [ -B ] [ -C frames ] [ -X secs ] [ -j workers ] [ -D threads ] [ -A threads ] [ -l count ] [ -F ms ] [ -R secs ] [ -N dB ] [ --welch file ] [ --mesm file ] [ --thd file ] [ --crosstalk file ] [ --stepped file ] [ --average file ] [ --drift file [ --drift-lock ] ] [ --tdoa file [ --tdoa-pairs a:b,... ] ] [ --levels file [ --levels-interval secs ] ] [ --spectrum name [ --spectrum-decimate factor ] ] [ --no-audio ] [ -i <inports> ] [ -o <outports> ] [ -s file=<outports> ]... [ -c file[@rate]=<inports> ]... infile [ outfile[@rate] ]\n"
+ "            <inports> and <outports> are `,' separated\n"
+ "            -s plays another file to its own ports, starting on the same frame as infile\n"
+ "            -c captures other ports to another file, with its own format and sample rate\n"
+ "            the format of a capture follows its extension: .wav .w64 .rf64 .aiff .caf .flac .ogg\n"
+ "            -w sets the ring watermark, in percent, at which IO threads are woken\n"
+ "            -S lets IO threads spin for up to usecs polling their ring before sleeping\n"
+ "            -j shares the files between this many IO threads, by default one per file up to one per core\n"
+ "            -D decodes each input file on this many threads, by default FLAC and Ogg files only\n"
+ "            -A shares the analysis of the channels among this many threads, by default up to four\n"
+ "            -l plays the input files count times over from memory, 0 for ever, -F crossfades the repeats over ms\n"
+ "            -R starts new capture files, numbered outfile-0000 and on, every secs\n"
+ "            -N compares each captured channel with the played one as it runs, failing on any error above dB\n"
+ "               --null-latency frames sets the delay instead of asking jack, --null-discard deletes a capture that passes\n"
+ "            -s and infile may be sweep:low:high:secs, a generated sweep played on each port in turn, overlapping\n"
+ "               --mesm file writes the impulse responses of each sweep port to file-NN.wav, --mesm-ir secs long\n"
+ "               --thd file writes the harmonic distortion from sweep port n to input n\n"
+ "            -s and infile may be noise:secs, played on each port in turn\n"
+ "               --crosstalk file writes the level from each noise port to each input in octave bands\n"
+ "            -s and infile may be steps:low:high:count, sine tones each played until --stepped file has measured it\n"
+ "            --drift file logs the drift of the first input against the first output, and --drift-lock resamples every capture to cancel it\n"
+ "            --tdoa file logs the delay between pairs of inputs, the first and each other one unless --tdoa-pairs gives them\n"
+ "            --levels file logs third-octave, A and C weighted levels and loudness of every input each --levels-interval secs, 1 by default\n"
+ "            --spectrum name publishes the spectrum of every input, decimated by --spectrum-decimate, 4 by default, in the shared memory segment name\n"
+ "            --no-audio writes no capture files, only the analysis, and outfile may be left out\n"
+ "            --average file writes the mean of the repeats of a looped infile, and stops the loop once it is --snr dB clean\n"
+ "            --welch file writes the transfer function from the first output to each input, Welch averaged over --welch-size frames\n"
+ "            -p keeps capturing for ms after playback ends, -L adds the port latency to it\n"
+ "            -T writes outfile.times, mapping a captured frame to clock time every ms\n"
+ "            -B writes a broadcast wave (bext) header with the capture start time\n"
+ "            -C writes outfile.crc32c, a checksum of every block of frames\n"
+ "            -X writes outfile.idx, the file position of a frame every secs\n"
+ "       recapture --verify file...\n"
+ "            checks files against their .crc32c checksums\n";
 
 #if 1
 #define DEBUG(...) (fprintf(stderr, "recapture: "), fprintf(stderr, __VA_ARGS__))
@@ -46,8 +91,11 @@ const char* usage =
 // Usage notice and some useful macros.
 
 #define MAX_PORTS 30
+#define MAX_SOURCES 8
+#define MAX_SINKS 8
+#define CACHE_LINE 64
 
-// A sensible number given 24 input and output ports. To be a truly general program this would need to be a variable able to be overridden by a command line argument.
+// A sensible number given 24 input and output ports. To be a truly general program this would need to be a variable able to be overridden by a command line argument. The ports are shared between up to MAX_SOURCES files played and MAX_SINKS files captured at once. CACHE_LINE is used to keep data shared between threads from sharing a cache line with anything else.
 // Structs and typedefs
 
 typedef jack_default_audio_sample_t recap_sample_t;
@@ -55,57 +103,292 @@ typedef jack_default_audio_sample_t recap_sample_t;
 // jack_default_audio_sample_t is a little long.
 
 typedef enum _recap_status {
- IDLE, RUNNING, DONE
+ IDLE, PREFILLED, RUNNING, DRAINING, DONE
 } recap_status_t;
 
-// This program starts two extra threads. The main thread sets up a number of callbacks which the jack process runs in realtime. The two extra threads are a read thread and a write thread. This split is necessary because reading and writing cannot occur within a realtime thread without wrecking its realtime guarantees. The read and write threads are connected to the jack thread by a ringbuffer each.
+#define RECAP_PHASE 0x0f
+#define RECAP_EOF(n)    (0x10u << (n))
+#define RECAP_PRIMED(n) (0x1000u << (n))
+#define RECAP_DRAINED(n) (0x100000u << (n))
+
+// This program starts extra threads. The main thread sets up a number of callbacks which the jack process runs in realtime. The extra threads are a read thread for each file being played and a write thread for each file being captured. This split is necessary because reading and writing cannot occur within a realtime thread without wrecking its realtime guarantees. The read and write threads are connected to the jack thread by a ringbuffer each.
 
-// Before initial synchronization the read thread is IDLE, once reading has commenced it is RUNNING, and when reading is finished it is DONE. The jack processing thread also uses IDLE and DONE.
+// The session moves through IDLE (setting up), PREFILLED (every read thread has filled its playback ring), RUNNING (playing and capturing), DRAINING (playback has finished and the write thread is emptying the capture ring) and DONE. Each read thread n raises RECAP_PRIMED(n) after its first fill and RECAP_EOF(n) once it has reached the end of its file, and each write thread n raises RECAP_DRAINED(n) once it has emptied its ring for the last time.
 
 typedef struct _recap_state {
- volatile int can_play;
- volatile int can_capture;
- volatile int can_read;
- volatile recap_status_t reading;
- volatile recap_status_t playing;
+ _Alignas(CACHE_LINE) atomic_uint word;
+ char pad[CACHE_LINE - sizeof(atomic_uint)];
 } recap_state_t;
 
-// A single instance of this struct is shared among all three threads. Play and record start when can_play, can_capture, and can_read (which correspond to the three threads) are all true; they finish when reading and playing are both DONE.
+// A single instance of this struct is shared among all threads. The phase and flags live in one atomic word on a cache line of its own, so the jack thread can check whether it has anything to do with a single load per cycle.
+
+typedef struct _recap_stamp {
+ sf_count_t frame;
+ jack_nframes_t jack_frame;
+ jack_time_t usecs;
+ float period_usecs;
+} recap_stamp_t;
+
+#define STAMP_SLOTS 256
+
+typedef struct _recap_stamps {
+ recap_stamp_t slot[STAMP_SLOTS];
+ _Alignas(CACHE_LINE) atomic_uint head;
+ _Alignas(CACHE_LINE) atomic_uint tail;
+ recap_stamp_t first;
+ int have_first;
+ long long first_realtime_ns;
+ recap_stamp_t last;
+ long long last_realtime_ns;
+ FILE* file;
+} recap_stamps_t;
+
+// A timestamp ties a captured frame to the jack frame time and jack microsecond clock at the start of the cycle it was captured in. The jack thread records them into a preallocated single producer, single consumer table which the writer thread empties; head and tail are kept on separate cache lines. The writer keeps the stamps of the first and the latest captured frame, along with their CLOCK_REALTIME times, and, if a sidecar was asked for, writes every stamp to file.
+
+#define RESAMPLE_HALF 32
+#define RESAMPLE_PHASES 256
+
+typedef struct _recap_resampler {
+ double step;
+ double nominal;
+ double pos;
+ int channels;
+ float* kernel;
+ float* hist;
+ size_t hist_frames;
+ size_t hist_size;
+ float* out;
+ size_t out_size;
+ sf_count_t in_total;
+ sf_count_t out_total;
+ sf_count_t dropped;
+ double mark_in;
+ sf_count_t mark_out;
+} recap_resampler_t;
+
+// A windowed sinc resampler. step is the number of input frames per output frame and pos is the position of the next output frame in hist, which keeps the input frames still needed, RESAMPLE_HALF either side of pos. step may be changed between calls to follow a ratio that varies, around nominal, the ratio of the two sample rates.
+
+// Once step has varied the output is no longer the input scaled by one ratio, so the resampler keeps track of where it is: dropped counts the input frames dropped from hist, and each call marks the input frame that output frame mark_out lies on, mark_in. Input frames are mapped to output frames from the latest mark at the step in use since.
+
+#define DECODE_CHUNK 32768
+#define MAX_DECODERS 8
+
+typedef struct _recap_block {
+ float* data;
+ sf_count_t frames;
+ long chunk;
+ int ready;
+} recap_block_t;
+
+typedef struct _recap_decoder {
+ struct _recap_io_info* info;
+ int threads;
+ pthread_t thread_id[MAX_DECODERS];
+ SNDFILE* file[MAX_DECODERS];
+ sf_count_t length;
+ long chunks;
+ recap_block_t block[2 * MAX_DECODERS];
+ int blocks;
+ atomic_long next_chunk;
+ long consumed;
+ sf_count_t offset;
+ int stop;
+ int status;
+ pthread_mutex_t lock;
+ pthread_cond_t cond;
+} recap_decoder_t;
+
+// A decoder splits a compressed input file into chunks of DECODE_CHUNK frames and decodes them on several threads at once, each with its own handle on the file, into a ring of blocks which the reader empties in order. A thread takes the next chunk from next_chunk and decodes it into block chunk % blocks once the reader has finished with the chunk before it there, which is when the block's chunk is set to this one. consumed is the chunk the reader is on and offset how far into it the reader has got.
+
+#define SWEEP_LEVEL 0.5
+#define MESM_ORDER 5
+#define MESM_REGULARIZE 1e-6
+#define NOISE_GAP 0.2
+
+typedef struct _recap_sweep {
+ double low;
+ double high;
+ double secs;
+ int rate;
+ sf_count_t length;
+ sf_count_t stagger;
+ sf_count_t tail;
+ int noise;
+} recap_sweep_t;
+
+// A generated exponential sweep from low to high Hz, secs long, which is length frames at rate, or white noise of the same length if noise is set. A source with several channels plays it on each in turn, stagger frames apart, and then tail frames of silence.
+
+#define MAX_STEPS 256
+
+typedef struct _recap_tone {
+ double low;
+ double high;
+ int steps;
+ int rate;
+ int step;
+ double phase;
+ double increment;
+ sf_count_t start[MAX_STEPS];
+ atomic_int started;
+ atomic_int wanted;
+} recap_tone_t;
+
+// A stepped sine, generated by the jack thread, which steps through steps tones from low to high Hz as the analysis asks for them. The analysis sets wanted to the step it wants next, and the jack thread, which owns step, phase and increment, moves on to it and sets started to one more than the step once start holds the frame the step began on.
 
 typedef struct _recap_io_info {
- pthread_t thread_id;
+ const struct _recap_stream_ops* ops;
+ int home;
+ atomic_int claimed;
+ atomic_int cleaned;
+ int status;
+ int index;
  char* path;
  SNDFILE* file;
+ int channels;
+ int frame_size;
+ int port_offset;
+ int rate;
  jack_ringbuffer_t* ring;
  long underruns;
+ int underfill;
+ sf_count_t frames;
+ sf_count_t played;
+ int played_out;
+ size_t wake_space;
+ recap_stamps_t* stamps;
+ char** port_names;
+ FILE* crc_file;
+ uint32_t crc;
+ sf_count_t crc_frames;
+ long crc_blocks;
+ int format;
+ sf_count_t data_offset;
+ FILE* index_file;
+ sf_count_t next_index;
+ recap_resampler_t* resampler;
+ recap_decoder_t* decoder;
+ recap_sweep_t* sweep;
+ recap_tone_t* tone;
+ float* loop_data;
+ sf_count_t loop_length;
+ sf_count_t loop_fade;
+ sf_count_t loop_pos;
+ atomic_int loop_stop;
+ sf_count_t loop_end;
+ char* base_path;
+ char segment_path[PATH_MAX];
+ long segment;
+ sf_count_t segment_start;
+ sf_count_t segment_frames;
  recap_state_t* state;
 } recap_io_info_t;
 
-// Both read and write threads receive an instance of this struct as their only argument.
+// Each file played or captured is a stream, described by an instance of this struct. ops are the reader or writer functions that serve it. Any IO thread may serve a stream, but only one at a time: a thread claims the stream by setting claimed to its index plus one, and a stream that has finished stays claimed. home is the thread that is woken when the stream needs serving, and status is the stream's exit status. channels is the number of channels the stream reads or writes, frame_size the size of a frame of them in the ring, port_offset the first of the jack ports they are played to or captured from, and port_names the names of the jack ports they are connected to. wake_space is the number of bytes of work (free space for the reader, queued data for the writer) that must build up in the ring before the jack thread bothers to wake a thread.
+
+// frames counts a stream's progress. A reader's frames is the number of frames it has moved through its ring; the reader stops updating it before raising RECAP_EOF, after which it is the exact length of the input and may be read by the jack thread. A writer's frames is the number of frames written to its current file, and starts again from zero with each new file. played and played_out belong to the jack thread, and count the frames of a reader's file played so far and mark when the last of them has gone.
+
+// A reader of a compressed file has a decoder, one that generates a sweep has its sweep, and one that plays stepped sines its tone. A looping reader plays loop_length frames of loop_data over and over, crossfading loop_fade frames, and is loop_pos frames into it. Setting loop_stop asks it to stop at the end of the repeat it is reading, which it makes loop_end.
+
+// rate is the sample rate of a writer's file, which may differ from jack's, in which case the writer has a resampler. format is the libsndfile format of the file and data_offset the size of its header. Only writers have a table of stamps. With checksums enabled the writer keeps the running CRC of the current block, the number of frames in it so far, and the number of blocks written to crc_file. With an index, next_index is the next frame to be entered in index_file. A writer that rotates its output writes segment_frames frames to each file, named after base_path; segment is the number of the current file and segment_start the frame of the capture it starts at.
+
+typedef struct _recap_worker {
+ pthread_t thread_id;
+ pthread_mutex_t lock;
+ pthread_cond_t cond;
+ int index;
+ long spin_hits;
+ long parks;
+ long steals;
+} recap_worker_t;
+
+// The IO threads are a pool of workers sharing the streams between them. Each has its own lock and condition variable to be woken with. spin_hits and parks count how often the worker found work while spinning and how often it had to sleep on its condition variable, and steals how often it served a stream homed on another worker.
+
+#define ANALYSIS_BLOCK 4096
+#define MAX_ANALYSERS 10
+#define MAX_HELPERS 7
+
+typedef struct _recap_analyser recap_analyser_t;
+typedef int (*analyse_start_fn) (recap_analyser_t*);
+typedef void (*analyse_block_fn) (recap_analyser_t*, float** played, float** captured, sf_count_t frame, sf_count_t nframes);
+typedef int (*analyse_finish_fn) (recap_analyser_t*);
+typedef void (*analyse_release_fn) (recap_analyser_t*);
+typedef void (*analysis_job_fn) (void*, int);
+
+struct _recap_analyser {
+ const char* name;
+ analyse_start_fn start;
+ analyse_block_fn block;
+ analyse_finish_fn finish;
+ analyse_release_fn release;
+ void* state;
+};
+
+typedef struct _recap_analysis {
+ pthread_t thread_id;
+ pthread_mutex_t lock;
+ pthread_cond_t cond;
+ jack_ringbuffer_t* ring;
+ int played;
+ int captured;
+ size_t frame_size;
+ size_t wake_space;
+ float* block;
+ float* channel[2 * MAX_PORTS];
+ sf_count_t frames;
+ jack_nframes_t rate;
+ long overruns;
+ int status;
+ recap_analyser_t analyser[MAX_ANALYSERS];
+ int count;
+ int helpers;
+ pthread_t helper_id[MAX_HELPERS];
+ pthread_mutex_t job_lock;
+ pthread_cond_t job_cond;
+ pthread_cond_t done_cond;
+ analysis_job_fn job;
+ void* job_arg;
+ int job_count;
+ atomic_ullong job_next;
+ int jobs_done;
+ int active;
+ long generation;
+ int stop;
+ recap_state_t* state;
+} recap_analysis_t;
+
+// Analysis runs alongside capture on a thread of its own. The jack thread copies the frames it plays and captures each cycle, played channels first, into ring, and the analysis thread takes them out a block at a time, splits them into a channel array each, and hands them to every analyser in turn. An analyser's start function is called once the ports are connected and before playback starts, its block function with each block, and its finish function when the capture is over; the last returns non zero if the analyser failed the run. finish reports the results and then calls release, which frees the analyser's state and closes its files without reporting anything, and which is called on its own for an analyser that never gets to finish. The analysis thread has helpers to share work that can be split by channel with, which wait on job_cond for a new generation of jobs. job_next holds the generation in its upper 32 bits and the next index of it in the lower ones.
 
 typedef struct _recap_process_info {
  long overruns;
  long underruns;
- recap_io_info_t* writer_info;
- recap_io_info_t* reader_info;
+ int played_out;
+ jack_nframes_t postroll;
+ jack_nframes_t postroll_left;
+ sf_count_t captured;
+ sf_count_t next_stamp;
+ jack_nframes_t stamp_interval;
+ long stamps_dropped;
+ recap_io_info_t* writers;
+ int writer_count;
+ int sink_count;
+ recap_io_info_t* readers;
+ int reader_count;
+ recap_worker_t* workers;
+ int worker_count;
+ atomic_int streams_left;
+ recap_analysis_t* analysis;
+ atomic_long drift_ppb;
  recap_state_t* state;
 } recap_process_info_t;
 
-// An instance of this struct is passed to the callback responsible for processing the signals.
+// An instance of this struct is passed to the callback responsible for processing the signals. played_out is set once the last frame of every file has been played. postroll is the number of frames to keep capturing after that, and postroll_left how many of them are still to come. captured counts the frames captured so far; a timestamp is recorded when it reaches next_stamp, which then moves on by stamp_interval frames. streams_left counts the streams whose IO has not finished; the workers exit when it reaches zero. sink_count is the number of writers that write a file: all of them, or none with --no-audio, when the writers only say which ports are captured and the frames go to the analysis alone.
 // Global values
 
 const size_t sample_size = sizeof(recap_sample_t);
 
 // This works out to be the size of a 32 bit float. Not bad given the sample size of CD audio is 16 bits.
 
-typedef recap_sample_t (*next_value_fn) (void*);
-
-pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t ready_to_read = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t ready_to_write = PTHREAD_COND_INITIALIZER;
-
-// Locks and condition variables for each IO thread.
+typedef int (*next_value_fn) (recap_sample_t*, void*);
 
 recap_process_info_t* proc_info;
 
@@ -113,17 +396,77 @@ recap_process_info_t* proc_info;
 
 /* read only after initialization in main() */
 int channel_count_r = 0;
-int frame_size_r = 0;
 int channel_count_w = 0;
-int frame_size_w = 0;
 jack_nframes_t ring_size = 65536; /* pow(4, 8) */
+int wake_percent = 50;
+long spin_usecs = 0;
+int io_workers = 0;
+int decode_threads = -1;
+long loop_count = 1;
+long crossfade_ms = 0;
+long rotate_secs = 0;
+int null_test = 0;
+double null_db = 0.0;
+long null_latency = -1;
+int null_discard = 0;
+char* welch_path = NULL;
+int welch_size = 8192;
+int analysis_threads = -1;
+char* crosstalk_path = NULL;
+char* stepped_path = NULL;
+char* average_path = NULL;
+double average_snr_db = 60.0;
+char* mesm_path = NULL;
+char* thd_path = NULL;
+char* drift_path = NULL;
+int drift_lock = 0;
+char* tdoa_path = NULL;
+char* tdoa_pairs = NULL;
+int no_audio = 0;
+char* levels_path = NULL;
+double levels_interval = 1.0;
+char* spectrum_name = NULL;
+int spectrum_decimate = 4;
+double mesm_ir_secs = 0.5;
+long postroll_ms = 0;
+int postroll_latency = 0;
+long stamp_ms = 0;
+int bwf = 0;
+sf_count_t crc_block = 0;
+long index_secs = 0;
 jack_port_t* recap_in_ports[MAX_PORTS];
 jack_port_t* recap_out_ports[MAX_PORTS];
 jack_client_t* client;
 
 // Variables that are not changed subsequent to initialization and therefore do not need to be in thread specific structs.
 
-// channel_count_r and channel_count_w hold the number of read and write signals. The frame_size of each is calculated by multiplying the channel count by the sample size. The default ring_size can be overridden by command line argument. recap_in_ports and recap_out_ports will hold the jack ports this client connects to.
+// channel_count_r and channel_count_w hold the number of read and write signals, counting every file played or captured. The default ring_size can be overridden by command line argument, as can wake_percent, the ring watermark at which the IO threads are woken, spin_usecs, how long an IO thread busy waits before sleeping, postroll_ms and postroll_latency, which set how long capture continues after playback, stamp_ms, the interval between timestamps in the sidecar file, bwf, which selects broadcast wave output, crc_block, the number of frames covered by each checksum, and index_secs, the spacing of entries in the seek index. recap_in_ports and recap_out_ports will hold the jack ports this client connects to.
+// Session state
+
+static unsigned state_load(recap_state_t* state) {
+ return atomic_load_explicit(&state->word, memory_order_acquire);
+}
+
+static recap_status_t state_phase(recap_state_t* state) {
+ return state_load(state) & RECAP_PHASE;
+}
+
+static int state_advance(recap_state_t* state, recap_status_t from, recap_status_t to) {
+ unsigned word = atomic_load_explicit(&state->word, memory_order_relaxed);
+ while ((word & RECAP_PHASE) == from) {
+   unsigned next = (word & ~RECAP_PHASE) | to;
+   if (atomic_compare_exchange_weak_explicit(&state->word, &word, next,
+         memory_order_acq_rel, memory_order_relaxed))
+     return 1;
+ }
+ return 0;
+}
+
+static void state_raise(recap_state_t* state, unsigned flag) {
+ atomic_fetch_or_explicit(&state->word, flag, memory_order_release);
+}
+
+// Every transition is a compare and swap from an expected phase, so a thread can only move the session forward from the phase it thinks it is in, and flags are preserved. Transitions release and loads acquire: whatever a thread wrote to a ringbuffer before moving the state on is visible to a thread that observes the new state.
 // Helper functions
 
 static size_t array_length(char** array) {
@@ -143,30 +486,25 @@ int uninterleave(recap_sample_t** buffers, size_t length, size_t count,
  int k;
  for (i = 0; i < count; i++) {
    for (k = 0; k < length; k++) {
-     recap_sample_t sample = next_value(arg);
-     if (sample == -1) {
-       status = -1;
-       break;
-     } else {
-       buffers[k][i] = sample;
-     }
+     status = next_value(&buffers[k][i], arg);
+     if (status) break;
    }
    if (status) break;
  }
  return status;
 }
 
-recap_sample_t next_value(void* arg) {
- recap_sample_t sample;
+int next_value(recap_sample_t* sample, void* arg) {
+ int status = 0;
  jack_ringbuffer_t* rb = (jack_ringbuffer_t*) arg;
- size_t count = jack_ringbuffer_read(rb, (char*) &sample, sample_size);
- if (count < sample_size) sample = -1;
- return sample;
+ size_t count = jack_ringbuffer_read(rb, (char*) sample, sample_size);
+ if (count < sample_size) status = -1;
+ return status;
 }
 
 // libsndfile expects multichannel data to be interleaved. uninterleave() uses a supplied function to read interleaved data and writes it to an array of output buffers (one per channel).
 
-// next_value() simply reads the next sample_size bytes from the supplied ringbuffer.
+// next_value() simply reads the next sample_size bytes from the supplied ringbuffer. Failure is reported through the return value rather than a sentinel sample, since every float value is a legitimate sample.
 
 typedef int (*write_value_fn) (recap_sample_t, void*);
 
@@ -197,19 +535,36 @@ int write_value(recap_sample_t sample, void* arg) {
 
 // write_value() simple writes sample_size bytes to the supplied ringbuffer.
 
-static void recap_mute(recap_sample_t** buffers, int count, jack_nframes_t nframes) {
+static void recap_mute(recap_sample_t** buffers, int count, jack_nframes_t start, jack_nframes_t nframes) {
  int i;
- size_t bufsize = nframes * sample_size;
+ size_t bufsize = (nframes - start) * sample_size;
  for (i = 0; i < count; i++)
-   memset(buffers[i], 0, bufsize);
+   memset(buffers[i] + start, 0, bufsize);
 }
 
-// After playing has finished, jack output must be muted (zeroed) otherwise jack will continue playing whatever is left in the output buffers, looping through the last cycle of whatever signal was being played. Definitely not what you want.
+// After playing has finished, jack output must be muted (zeroed) otherwise jack will continue playing whatever is left in the output buffers, looping through the last cycle of whatever signal was being played. Definitely not what you want. Frames before start are left alone, so the tail of a partially played cycle can be silenced too.
 // Signal handling
 
+static long total_underruns(recap_process_info_t* info) {
+ long underruns = info->underruns;
+ int i;
+ for (i = 0; i < info->reader_count; i++)
+   underruns += info->readers[i].underruns;
+ return underruns;
+}
+
+// Underruns counted by the jack thread and by each of the readers.
+
 static void cancel_process(recap_process_info_t* info) {
- pthread_cancel(info->reader_info->thread_id);
- pthread_cancel(info->writer_info->thread_id);
+ int i;
+ atomic_store(&info->state->word, DONE);
+ for (i = 0; i < info->worker_count; i++)
+   pthread_cancel(info->workers[i].thread_id);
+ if (info->analysis && info->analysis->thread_id) {
+   pthread_cancel(info->analysis->thread_id);
+   for (i = 0; i < info->analysis->helpers; i++)
+     pthread_cancel(info->analysis->helper_id[i]);
+ }
 }
 
 static void signal_handler(int sig) {
@@ -229,30 +584,26 @@ static void jack_shutdown(void* arg) {
 typedef int (*io_thread_fn) (recap_io_info_t*);
 typedef void (*cleanup_fn) (void*);
 
+typedef int (*io_test_fn) (recap_io_info_t*);
+
 #define FINISHED -1
 
-static void* common_thread(pthread_mutex_t* lock, pthread_cond_t* cond, io_thread_fn fn, cleanup_fn cu, void* arg) {
- int* exit = (int*) malloc(sizeof(int*));
- memset(exit, 0, sizeof(*exit));
- int status = 0;
- recap_io_info_t* info = (recap_io_info_t*) arg;
- pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
- pthread_cleanup_push(cu, arg);
- pthread_mutex_lock(lock);
- while (1) {
-   if ((status = fn(info)) != 0) break;
-   pthread_cond_wait(cond, lock);
- }
- pthread_mutex_unlock(lock);
- *exit = status;
- if (status == FINISHED) *exit = 0;
- pthread_exit(exit);
- pthread_cleanup_pop(1);
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define cpu_relax() __asm__ __volatile__("yield")
+#else
+#define cpu_relax() do { } while (0)
+#endif
+
+static long elapsed_usecs(struct timespec* start) {
+ struct timespec now;
+ clock_gettime(CLOCK_MONOTONIC, &now);
+ return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
 }
 
-// This abstracts out the common parts of setting up a thread and its loop. The supplied io_thread_fn function is executed every iteration until it returns non zero. The supplied cleanup_fn is called whenever the thread is exited. After each iteration the thread waits until it is signalled to continue.
+// cpu_relax() eases off the cpu between polls while an IO thread spins, and elapsed_usecs() bounds how long it spins for.
 
-typedef int (*io_test_fn) (recap_io_info_t*);
 typedef size_t (*io_size_fn) (recap_io_info_t*);
 typedef int (*io_body_fn) (void*, size_t, recap_io_info_t*);
 
@@ -274,348 +625,4527 @@ static int io_thread(io_test_fn can_run, io_test_fn is_done, io_size_fn ring_spa
 // Further abstracted out is the code common to the read and write threads. io_test_fn checks when the thread is finished and should exit; io_size_fn returns how much read or write space is available; io_body_fn contains code specific to reading or writing.
 
 // It would be good to malloc void* buf only once at the beginning of the thread to ensure no pagefaults. However, since the allocation does not occur in a realtime thread and no overruns or underruns (dropouts) were observed in testing, it was not a high priority to fix.
-// Thread implementation
-
-static int reader_can_run(recap_io_info_t* info) {
- return info->state->can_read;
+// Sample rate conversion
+
+static recap_resampler_t* resampler_new(int channels, double step) {
+ recap_resampler_t* rs = (recap_resampler_t*) calloc(1, sizeof(recap_resampler_t));
+ size_t size = RESAMPLE_HALF * RESAMPLE_PHASES + 2;
+ double cutoff = 0.95 * (step > 1.0 ? 1.0 / step : 1.0);
+ size_t i;
+ rs->step = step;
+ rs->nominal = step;
+ rs->channels = channels;
+ rs->kernel = (float*) malloc(size * sizeof(float));
+ for (i = 0; i < size; i++) {
+   double x = (double) i / RESAMPLE_PHASES;
+   double w = 0.0;
+   double sinc = 1.0;
+   if (x < RESAMPLE_HALF)
+     w = 0.42 + 0.5 * cos(M_PI * x / RESAMPLE_HALF) + 0.08 * cos(2 * M_PI * x / RESAMPLE_HALF);
+   if (x > 0.0)
+     sinc = sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+   rs->kernel[i] = cutoff * sinc * w;
+ }
+ rs->hist_size = 4 * RESAMPLE_HALF;
+ rs->hist = (float*) calloc(rs->hist_size * channels, sizeof(float));
+ rs->hist_frames = RESAMPLE_HALF;
+ rs->pos = RESAMPLE_HALF;
+ return rs;
 }
 
-static int writer_can_run(recap_io_info_t* info) {
- return info->state->can_capture;
+static void resampler_free(recap_resampler_t* rs) {
+ if (rs == NULL) return;
+ free(rs->kernel);
+ free(rs->hist);
+ free(rs->out);
+ free(rs);
 }
 
-static int reader_is_done(recap_io_info_t* info) {
- return 0;
+// The kernel is a Blackman windowed sinc, tabulated RESAMPLE_PHASES times per input frame out to RESAMPLE_HALF frames. Its cutoff is a little below the lower of the two Nyquist frequencies. hist starts with RESAMPLE_HALF frames of silence so that the first output frame lines up with the first input frame.
+
+static float kernel_at(recap_resampler_t* rs, double x) {
+ double at = fabs(x) * RESAMPLE_PHASES;
+ size_t i = (size_t) at;
+ float frac = at - i;
+ return rs->kernel[i] + frac * (rs->kernel[i + 1] - rs->kernel[i]);
 }
 
-static int writer_is_done(recap_io_info_t* info) {
- return jack_ringbuffer_read_space(info->ring) == 0 && info->state->playing == DONE;
+static size_t resample(recap_resampler_t* rs, const float* in, size_t nframes) {
+ int channels = rs->channels;
+ if (rs->hist_frames + nframes > rs->hist_size) {
+   rs->hist_size = rs->hist_frames + nframes;
+   rs->hist = (float*) realloc(rs->hist, rs->hist_size * channels * sizeof(float));
+ }
+ rs->mark_in = rs->dropped + rs->pos - RESAMPLE_HALF;
+ rs->mark_out = rs->out_total;
+ memcpy(rs->hist + rs->hist_frames * channels, in, nframes * channels * sizeof(float));
+ rs->hist_frames += nframes;
+ rs->in_total += nframes;
+
+ size_t most = (size_t) (rs->hist_frames / rs->step) + 1;
+ if (most > rs->out_size) {
+   rs->out_size = most;
+   rs->out = (float*) realloc(rs->out, most * channels * sizeof(float));
+ }
+ size_t count = 0;
+ while ((size_t) rs->pos + RESAMPLE_HALF < rs->hist_frames) {
+   size_t centre = (size_t) rs->pos;
+   float* out = rs->out + count * channels;
+   size_t k;
+   int c;
+   memset(out, 0, channels * sizeof(float));
+   for (k = centre + 1 - RESAMPLE_HALF; k <= centre + RESAMPLE_HALF; k++) {
+     float weight = kernel_at(rs, rs->pos - k);
+     const float* frame = rs->hist + k * channels;
+     c = 0;
+#if defined(__x86_64__)
+     __m128 weight4 = _mm_set1_ps(weight);
+     for (; c + 4 <= channels; c += 4)
+       _mm_storeu_ps(out + c, _mm_add_ps(_mm_loadu_ps(out + c), _mm_mul_ps(weight4, _mm_loadu_ps(frame + c))));
+#endif
+     for (; c < channels; c++)
+       out[c] += weight * frame[c];
+   }
+   ++count;
+   rs->pos += rs->step;
+ }
+ rs->out_total += count;
+
+ size_t drop = (size_t) rs->pos - RESAMPLE_HALF;
+ if (drop > rs->hist_frames) drop = rs->hist_frames;
+ memmove(rs->hist, rs->hist + drop * channels, (rs->hist_frames - drop) * channels * sizeof(float));
+ rs->hist_frames -= drop;
+ rs->dropped += drop;
+ rs->pos -= drop;
+ return count;
 }
 
-static size_t reader_space(recap_io_info_t* info) {
- return jack_ringbuffer_write_space(info->ring);
+// Convert nframes of interleaved input, leaving the output frames in rs->out and returning how many there are. Each output frame is computed as soon as the RESAMPLE_HALF input frames after it have arrived, and the input frames no longer needed are dropped from hist. Each tap is applied to four channels at a time with SSE2.
+
+static sf_count_t resampled_frame(recap_resampler_t* rs, sf_count_t frame) {
+ return rs->mark_out + llround((frame - rs->mark_in) / rs->step);
 }
 
-static size_t writer_space(recap_io_info_t* info) {
- return jack_ringbuffer_read_space(info->ring);
+// The output frame that input frame lies on, or the nearest to it.
+
+static size_t resample_flush(recap_resampler_t* rs) {
+ sf_count_t want = resampled_frame(rs, rs->in_total) - rs->out_total;
+ sf_count_t in_total = rs->in_total;
+ float* silence = (float*) calloc(2 * RESAMPLE_HALF * rs->channels, sizeof(float));
+ size_t count = resample(rs, silence, 2 * RESAMPLE_HALF);
+ free(silence);
+ rs->in_total = in_total;
+ if (want < 0) want = 0;
+ if (count > want) count = want;
+ return count;
 }
 
-// Read and write implementations of the above typedefs.
+// At the end of the capture the input is padded with silence to compute the last output frames, and the output is cut to the length of the input at the new rate, as it was mapped before the padding moved the mark.
+// Capture timestamps
 
-static int reader_body(void* buf, size_t space, recap_io_info_t* info) {
- static int underfill = 0;
- int status = 0;
- sf_count_t nframes = space / frame_size_r;
- sf_count_t frame_count = sf_readf_float(info->file, buf, nframes);
- if (frame_count == 0) {
-   DEBUG("reached end of sndfile: %s\n", info->path);
-   info->state->reading = DONE;
-   status = FINISHED;
- } else if (underfill > 0) {
-   ERR("cannot read sndfile: %s\n", info->path);
-   status = EIO;
- } else {
-   sf_count_t size = frame_count * frame_size_r;
-   if (jack_ringbuffer_write(info->ring, buf, size) < size) {
-     ++info->underruns;
-     ERR("reader thread: buffer underrun\n");
-   }
-   DEBUG("read %6ld frames\n", (long int) frame_count);
-   info->state->reading = RUNNING;
-   if (frame_count < nframes && underfill == 0) {
-     DEBUG("expected %ld frames but only read %ld,\n", (long int) nframes, (long int) frame_count);
-     DEBUG("wait for one cycle to make sure.\n");
-     ++underfill;
+static void record_stamp(recap_process_info_t* info) {
+ recap_stamp_t now;
+ jack_time_t next_usecs;
+ int i;
+ now.frame = info->captured;
+ jack_get_cycle_times(client, &now.jack_frame, &now.usecs,
+                      &next_usecs, &now.period_usecs);
+ for (i = 0; i < info->sink_count; i++) {
+   recap_stamps_t* stamps = info->writers[i].stamps;
+   unsigned head = atomic_load_explicit(&stamps->head, memory_order_relaxed);
+   unsigned tail = atomic_load_explicit(&stamps->tail, memory_order_acquire);
+   if (head - tail >= STAMP_SLOTS) {
+     ++info->stamps_dropped;
+   } else {
+     stamps->slot[head % STAMP_SLOTS] = now;
+     atomic_store_explicit(&stamps->head, head + 1, memory_order_release);
    }
  }
- return status;
+ if (info->stamp_interval == 0) {
+   info->next_stamp = INT64_MAX;
+ } else {
+   while (info->next_stamp <= info->captured)
+     info->next_stamp += info->stamp_interval;
+ }
 }
 
-// Reader implementation of io_body_fn. It is impossible to tell if the first underfill is caused by IO problems or by reaching the end of the sound file. If the frame count for the following cycle is zero, it is assumed that the end of the file has been reached; otherwise if underfill is greater than zero it must be an IO issue so the thread exits.
+// Called by the jack thread at the start of a cycle in which frames are captured, once captured has reached next_stamp. The first captured frame is always stamped; further stamps are only taken with -T. jack_get_cycle_times() gives the frame time and microsecond time of the start of the cycle, which is where the first frame captured in it lies. Every writer gets a copy of the stamp. If a writer has fallen so far behind that its table is full the stamp is dropped rather than waiting.
 
-// The use of static int underfill means no more than one reader thread can be active during the lifetime of the program.
+static long long timespec_ns(struct timespec* ts) {
+ return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
 
-static int writer_body(void* buf, size_t space, recap_io_info_t* info) {
- int status = 0;
- sf_count_t nframes = space / frame_size_w;
- jack_ringbuffer_read(info->ring, buf, space);
- if (sf_writef_float(info->file, buf, nframes) < nframes) {
-   ERR("cannot write sndfile (%s)\n", sf_strerror(info->file));
-   status = EIO;
+static void flush_stamps(recap_io_info_t* info) {
+ recap_stamps_t* stamps = info->stamps;
+ unsigned tail = atomic_load_explicit(&stamps->tail, memory_order_relaxed);
+ unsigned head = atomic_load_explicit(&stamps->head, memory_order_acquire);
+ if (tail == head) return;
+ struct timespec mono;
+ struct timespec real;
+ clock_gettime(CLOCK_MONOTONIC, &mono);
+ jack_time_t now = jack_get_time();
+ clock_gettime(CLOCK_REALTIME, &real);
+ long long mono_offset = timespec_ns(&mono) - (long long) now * 1000;
+ long long real_offset = timespec_ns(&real) - timespec_ns(&mono);
+ for (; tail != head; tail++) {
+   recap_stamp_t stamp = stamps->slot[tail % STAMP_SLOTS];
+   if (info->resampler)
+     stamp.frame = resampled_frame(info->resampler, stamp.frame);
+   if (info->segment_frames > 0 && stamp.frame >= info->segment_start + info->segment_frames)
+     break;
+   long long mono_ns = (long long) stamp.usecs * 1000 + mono_offset;
+   if (!stamps->have_first) {
+     stamps->first = stamp;
+     stamps->first_realtime_ns = mono_ns + real_offset;
+     stamps->have_first = 1;
+   }
+   stamps->last = stamp;
+   stamps->last_realtime_ns = mono_ns + real_offset;
+   if (stamps->file)
+     fprintf(stamps->file, "%lld %" PRIu32 " %" PRIu64 " %lld %lld %.3f\n",
+             (long long) (stamp.frame - info->segment_start), stamp.jack_frame, stamp.usecs,
+             mono_ns, mono_ns + real_offset, stamp.period_usecs);
  }
- DEBUG("wrote %5ld frames\n", (long int) nframes);
- return status;
+ atomic_store_explicit(&stamps->tail, tail, memory_order_release);
 }
 
-// Writer implementatino of io_body_fn.
+// Called by the writer thread. jack's microsecond clock is converted to CLOCK_MONOTONIC and CLOCK_REALTIME by sampling all three clocks together, so each line of the sidecar maps a captured frame index to both clocks in nanoseconds. The conversion is redone on every flush, which keeps it current if the system clock is slewed during a long capture. Captured frames are counted at jack's rate, so for a resampled file they are converted to frames of the file. With rotation the frames are given from the start of the current file, and stamps for the next file are left in the table until it is open.
+// Broadcast wave header
 
-static int reader_thread_fn(recap_io_info_t* info) {
- return io_thread(&reader_can_run, &reader_is_done,
-                  &reader_space, &reader_body, info);
-}
+#define BEXT_HISTORY 1024
 
-static int writer_thread_fn(recap_io_info_t* info) {
- return io_thread(&writer_can_run, &writer_is_done,
-                  &writer_space, &writer_body, info);
-}
+typedef SF_BROADCAST_INFO_VAR(BEXT_HISTORY) recap_bext_t;
 
-// Read and write implementations of io_thread_fn. Due to the earlier abstraction these definitions are simple.
+static void bext_mapping(char* str, size_t size, recap_io_info_t* info, const char* sep) {
+ int i;
+ size_t len = 0;
+ str[0] = '\0';
+ for (i = 0; i < info->channels && len < size; i++) {
+   const char* port = info->port_names[i] ? info->port_names[i] : "-";
+   len += snprintf(str + len, size - len, "%sin%i=%s", i ? sep : "", info->port_offset + i, port);
+ }
+}
 
-static void io_cleanup(void* arg) {
- recap_io_info_t* info = (recap_io_info_t*) arg;
- sf_close(info->file);
+static void fill_bext(recap_bext_t* bext, recap_io_info_t* info) {
+ char mapping[BEXT_HISTORY];
+ char stamp[16];
+ memset(bext, 0, sizeof(*bext));
+ strncpy(bext->originator, "recapture", sizeof(bext->originator));
+ bext->version = 1;
+ bext_mapping(mapping, sizeof(mapping), info, " ");
+ int len = snprintf(bext->description, sizeof(bext->description),
+                    "ring=%" PRIu32 " overruns=%ld underruns=%ld ", ring_size, proc_info->overruns,
+                    total_underruns(proc_info));
+ snprintf(bext->description + len, sizeof(bext->description) - len, "%.*s",
+          (int) (sizeof(bext->description) - len - 1), mapping);
+ bext_mapping(mapping, sizeof(mapping), info, "\r\n");
+ memset(bext->coding_history, ' ', BEXT_HISTORY - 3);
+ memcpy(bext->coding_history, mapping, strlen(mapping) < BEXT_HISTORY - 3 ? strlen(mapping) : BEXT_HISTORY - 3);
+ strcpy(bext->coding_history + BEXT_HISTORY - 3, "\r\n");
+ bext->coding_history_size = BEXT_HISTORY - 1;
+
+ recap_stamps_t* stamps = info->stamps;
+ if (stamps->have_first) {
+   time_t secs = stamps->first_realtime_ns / 1000000000LL;
+   long long nsecs = stamps->first_realtime_ns % 1000000000LL;
+   struct tm tm;
+   localtime_r(&secs, &tm);
+   strftime(stamp, sizeof(stamp), "%Y-%m-%d", &tm);
+   memcpy(bext->origination_date, stamp, sizeof(bext->origination_date));
+   strftime(stamp, sizeof(stamp), "%H:%M:%S", &tm);
+   memcpy(bext->origination_time, stamp, sizeof(bext->origination_time));
+   long long since_midnight = (tm.tm_hour * 3600LL + tm.tm_min * 60 + tm.tm_sec) * 1000000000LL + nsecs;
+   uint64_t reference = since_midnight / 1000 * info->rate / 1000000;
+   bext->time_reference_low = (uint32_t) reference;
+   bext->time_reference_high = (uint32_t) (reference >> 32);
+ }
 }
 
-static void io_free(recap_io_info_t* info) {
- jack_ringbuffer_free(info->ring);
+static int set_bext(recap_io_info_t* info) {
+ recap_bext_t bext;
+ int major = info->format & SF_FORMAT_TYPEMASK;
+ if (major != SF_FORMAT_WAV && major != SF_FORMAT_RF64) return 0;
+ fill_bext(&bext, info);
+ if (sf_command(info->file, SFC_SET_BROADCAST_INFO, &bext, sizeof(bext)) == SF_FALSE) {
+   ERR("cannot write broadcast wave header (%s)\n", sf_strerror(info->file));
+   return EIO;
+ }
+ return 0;
 }
 
-// io_cleanup() is passed to common_thread as the thread cleanup callback. io_free() is used at the end of main() to free resources which the jack thread may still be using after the IO threads exit.
+// With -B the output files that are WAV or RF64 are broadcast wave files. The bext chunk is set once when the file is opened, before any data has been written, which makes libsndfile reserve room for it in the header. When the writer finishes it is set again with the real values: the time reference (samples since midnight) and origination date and time of the first captured frame, and a description of the ring size, dropouts and channel to port mapping. The coding history, which also carries the mapping, is padded to a fixed length so that the chunk, and therefore the header, keeps the same size and libsndfile only has to rewrite the header in place.
+// Checksums
+
+static uint32_t crc32c_table[256];
 
-static void* writer_thread(void* arg) {
- return common_thread(&write_lock, &ready_to_write,
-                      &writer_thread_fn, &io_cleanup, arg);
+static void crc32c_init(void) {
+ uint32_t i;
+ int k;
+ for (i = 0; i < 256; i++) {
+   uint32_t crc = i;
+   for (k = 0; k < 8; k++)
+     crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+   crc32c_table[i] = crc;
+ }
 }
 
-static void* reader_thread(void* arg) {
- return common_thread(&read_lock, &ready_to_read,
-                      &reader_thread_fn, &io_cleanup, arg);
+static uint32_t crc32c_soft(uint32_t crc, const unsigned char* data, size_t len) {
+ while (len--)
+   crc = (crc >> 8) ^ crc32c_table[(crc ^ *data++) & 0xff];
+ return crc;
 }
 
-// Functions to start writer and reader threads.
-// Main jack callback
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char* data, size_t len) {
+ uint64_t crc64 = crc;
+ while (len >= 8) {
+   uint64_t word;
+   memcpy(&word, data, 8);
+   crc64 = _mm_crc32_u64(crc64, word);
+   data += 8;
+   len -= 8;
+ }
+ crc = (uint32_t) crc64;
+ while (len--)
+   crc = _mm_crc32_u8(crc, *data++);
+ return crc;
+}
+#endif
 
-static int process(jack_nframes_t nframes, void* arg) {
- recap_process_info_t* info = (recap_process_info_t*) arg;
- recap_state_t* state = info->state;
+static uint32_t crc32c(uint32_t crc, const void* data, size_t len) {
+#if defined(__x86_64__)
+ if (__builtin_cpu_supports("sse4.2"))
+   return crc32c_sse42(crc, data, len);
+#endif
+ return crc32c_soft(crc, data, len);
+}
 
-// The main jack callback. This function must read nframes of signal from the connected input ports and write nframes of signal to the connected output ports. The size of nframes is determined by the caller (jack).
+// CRC32C (the Castagnoli polynomial), which SSE4.2 computes in hardware eight bytes at a time. Where that is not available a table driven version gives the same result. The CRC is kept in its running form; it starts at ~0 and is inverted when a block is finished.
 
- if (!state->can_play || !state->can_capture || !state->can_read)
-   return 0;
+static void crc_block_done(recap_io_info_t* info) {
+ fprintf(info->crc_file, "%ld %lld %08" PRIx32 "\n", info->crc_blocks++,
+         (long long) info->crc_frames, ~info->crc);
+ info->crc = ~0U;
+ info->crc_frames = 0;
+}
 
-// No point reading or writing anything to jack?s buffers if everything isn?t ready to go.
+static void crc_frames(recap_io_info_t* info, const char* data, sf_count_t nframes, size_t frame_size) {
+ while (nframes > 0) {
+   sf_count_t take = crc_block - info->crc_frames;
+   if (take > nframes) take = nframes;
+   info->crc = crc32c(info->crc, data, take * frame_size);
+   info->crc_frames += take;
+   if (info->crc_frames == crc_block) crc_block_done(info);
+   data += take * frame_size;
+   nframes -= take;
+ }
+}
 
- recap_sample_t* in[MAX_PORTS];
- recap_sample_t* out[MAX_PORTS];
- int i = 0;
- jack_port_t* prt;
- while ((prt = recap_in_ports[i]) != NULL) {
-   in[i++] = (recap_sample_t*) jack_port_get_buffer(prt, nframes);
+// The writer checksums the frames just before they are written, while they are still in cache, one line per block of crc_block frames in the sidecar. The last block may be short.
+
+static int sample_bits(int format) {
+ switch (format & SF_FORMAT_SUBMASK) {
+ case SF_FORMAT_PCM_16: return 16;
+ case SF_FORMAT_PCM_24: return 24;
  }
- in[i] = NULL;
+ return 32;
+}
 
- i = 0;
- while ((prt = recap_out_ports[i]) != NULL) {
-   out[i++] = (recap_sample_t*) jack_port_get_buffer(prt, nframes);
+static void pcm_from_float(void* buf, size_t count, int bits) {
+ recap_sample_t* in = (recap_sample_t*) buf;
+ int32_t* out = (int32_t*) buf;
+ double scale = (double) (1LL << (bits - 1));
+ long long shift = 1LL << (32 - bits);
+ size_t i;
+ for (i = 0; i < count; i++) {
+   double v = in[i] * scale;
+   if (v >= scale - 1) v = scale - 1;
+   else if (v <= -scale) v = -scale;
+   out[i] = (int32_t) (lrint(v) * shift);
  }
- out[i] = NULL;
+}
 
-// Get the signal buffers of each input and output port. It is recommended in the jack documentation that these are not cached.
+// The output is PCM, so the writer converts samples itself, in place, and hands libsndfile integers, which it stores unchanged. Samples are rounded to the bit depth of the file first and left aligned in 32 bits, which is how libsndfile reads them back, so the checksums cover exactly the samples in the file and can be checked by reading it back as integers. Out of range samples are clipped rather than left to wrap around.
+// Seek index
+
+typedef struct _recap_index_header {
+ char magic[8];
+ uint32_t rate;
+ uint32_t interval;
+} recap_index_header_t;
+
+typedef struct _recap_index_entry {
+ int64_t frame;
+ int64_t offset;
+ int64_t realtime_ns;
+} recap_index_entry_t;
+
+// The index is a small header followed by one fixed size entry every interval frames, the nth entry being for frame n * interval. Finding any position is then a single seek into the index: entry = seconds * rate / interval.
+
+static int frame_bytes(int format, int channels) {
+ int major = format & SF_FORMAT_TYPEMASK;
+ if (major == SF_FORMAT_FLAC || major == SF_FORMAT_OGG) return 0;
+ switch (format & SF_FORMAT_SUBMASK) {
+ case SF_FORMAT_PCM_16: return 2 * channels;
+ case SF_FORMAT_PCM_24: return 3 * channels;
+ case SF_FORMAT_PCM_32:
+ case SF_FORMAT_FLOAT: return 4 * channels;
+ case SF_FORMAT_DOUBLE: return 8 * channels;
+ }
+ return 0;
+}
 
- if (state->playing != DONE && state->reading != IDLE) {
+static sf_count_t file_size(const char* path) {
+ struct stat st;
+ return stat(path, &st) == 0 ? st.st_size : -1;
+}
 
-// If state->reading is IDLE there is nothing to play yet, and if state->playing is DONE it is time to exit the program.
+// Uncompressed formats have a fixed number of bytes per frame, so the position of a frame is simply computed from the size of the header. For compressed formats frame_bytes() returns 0.
 
-   jack_ringbuffer_t* rring = info->reader_info->ring;
-   size_t space = jack_ringbuffer_read_space(rring);
-   if (space == 0 && state->reading == DONE) {
-     state->playing = DONE;
-     recap_mute(out, channel_count_r, nframes);
-   } else {
-     int err = uninterleave(out, channel_count_r, nframes, &next_value, rring);
-     if (err) {
-       ++info->underruns;
-       ERR("control thread: buffer underrun\n");
-     }
-   }
+static void index_entry(recap_io_info_t* info, int channels) {
+ recap_index_entry_t entry;
+ recap_stamps_t* stamps = info->stamps;
+ int bytes = frame_bytes(info->format, channels);
+ entry.frame = info->frames;
+ if (bytes > 0) {
+   entry.offset = info->data_offset + info->frames * bytes;
+ } else {
+   sf_write_sync(info->file);
+   entry.offset = file_size(info->path);
+ }
+ entry.realtime_ns = 0;
+ if (stamps->have_first)
+   entry.realtime_ns = stamps->last_realtime_ns +
+     (info->segment_start + info->frames - stamps->last.frame) * 1000000000LL / info->rate;
+ fwrite(&entry, sizeof(entry), 1, info->index_file);
+ info->next_index += (sf_count_t) index_secs * info->rate;
+}
 
-// This, the guts of the processing is simply uninterleaving the file data and writing it to the buffers of the appropriate output ports. Jack handles the rest.
+// Write the entry for the frame about to be written. The time of the frame is extrapolated from the latest capture timestamp. For compressed output the offset is the size of the file once the encoder has been flushed, which is as close as libsndfile lets us get: decoding from there reaches the indexed frame within one encoder block.
 
-   jack_ringbuffer_t* wring = info->writer_info->ring;
-   int err = interleave(in, channel_count_w, nframes, &write_value, wring);
-   if (err) {
-     ++info->overruns;
-     ERR("control thread: buffer overrun\n");
-   }
+static int open_index(recap_io_info_t* info) {
+ char index_path[PATH_MAX];
+ recap_index_header_t header;
+ snprintf(index_path, sizeof(index_path), "%s.idx", info->path);
+ if ((info->index_file = fopen(index_path, "w")) == NULL) {
+   ERR("cannot open index file \"%s\" (%s)\n", index_path, strerror(errno));
+   return EIO;
  }
+ memset(&header, 0, sizeof(header));
+ memcpy(header.magic, "RCIDX1", 6);
+ header.rate = info->rate;
+ header.interval = index_secs * header.rate;
+ fwrite(&header, sizeof(header), 1, info->index_file);
+ info->next_index = 0;
+ return 0;
+}
 
-// Similarly simple. Interleaving the input port data and writing to the writer thread?s ringbuffer.
+// Open outfile.idx and write its header. This has to happen after the output file's header is complete, when data_offset is known.
+// Output files
 
- if (pthread_mutex_trylock(&read_lock) == 0) {
-   pthread_cond_signal(&ready_to_read);
-   pthread_mutex_unlock(&read_lock);
+static void close_sink(recap_io_info_t* info) {
+ if (info->stamps->file) {
+   fclose(info->stamps->file);
+   info->stamps->file = NULL;
  }
-
- if (pthread_mutex_trylock(&write_lock) == 0) {
-   pthread_cond_signal(&ready_to_write);
-   pthread_mutex_unlock(&write_lock);
+ if (info->crc_file) {
+   if (info->crc_frames > 0) crc_block_done(info);
+   fclose(info->crc_file);
+   info->crc_file = NULL;
  }
- return 0;
+ if (info->index_file) {
+   fclose(info->index_file);
+   info->index_file = NULL;
+ }
+ if (bwf && info->file) set_bext(info);
+ if (info->file) sf_close(info->file);
+ info->file = NULL;
 }
 
-// Data has been written to the writer thread?s ringbuffer and removed from the reader thread?s ringbuffer, so signal each thread to begin another iteration.
-// Thread setup and running
+// Finish the sidecars and the broadcast wave header, and close the output file.
 
-static int setup_writer_thread(recap_io_info_t* info) {
+static int open_sink(recap_io_info_t* info) {
  int status = 0;
  SF_INFO sf_info;
- sf_info.samplerate = jack_get_sample_rate(client);
- sf_info.channels = channel_count_w;
- sf_info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_32;
+ sf_info.samplerate = info->rate;
+ sf_info.channels = info->channels;
+ sf_info.format = info->format;
  if ((info->file = sf_open(info->path, SFM_WRITE, &sf_info)) == NULL) {
    ERR("cannot open sndfile \"%s\" for output (%s)\n",
        info->path, sf_strerror(info->file));
-   jack_client_close(client);
-   status = EIO;
+   return EIO;
  }
  DEBUG("opened to write: %s\n", info->path);
- DEBUG("writing %i channels\n", channel_count_w);
- info->ring = jack_ringbuffer_create(sample_size * ring_size);
- memset(info->ring->buf, 0, info->ring->size);
- info->state->can_capture = 0;
- pthread_create(&info->thread_id, NULL, writer_thread, info);
- return status;
-}
-
-// Set up resources for the writer thread then create the thread. This means opening a (multichannel) WAV file to write to, creating a ringbuffer, and touching all its allocated memory to prevent pagefaults later on.
-
-static int setup_reader_thread(recap_io_info_t* info) {
- int status = 0;
- SF_INFO sf_info;
- sf_info.format = 0;
- DEBUG("opened to read: %s\n", info->path);
- if ((info->file = sf_open(info->path, SFM_READ, &sf_info)) == NULL) {
-   ERR("cannot read sndfile: %s\n", info->path);
-   status = EIO;
+ info->frames = 0;
+ if (stamp_ms > 0) {
+   char stamp_path[PATH_MAX];
+   snprintf(stamp_path, sizeof(stamp_path), "%s.times", info->path);
+   if ((info->stamps->file = fopen(stamp_path, "w")) == NULL) {
+     ERR("cannot open timestamp file \"%s\" (%s)\n", stamp_path, strerror(errno));
+     status = EIO;
+   } else {
+     fprintf(info->stamps->file, "# frame jack_frame jack_usecs monotonic_ns realtime_ns period_usecs\n");
+   }
  }
- channel_count_r = sf_info.channels;
- frame_size_r = channel_count_r * sample_size;
- DEBUG("reading %i channels\n", channel_count_r);
- if (sf_info.samplerate != 44100) {
-   ERR("jack sample rate must be 44100 (is %i)\n", sf_info.samplerate);
-   cancel_process(proc_info);
+ if (crc_block > 0 && (info->format & SF_FORMAT_SUBMASK) == SF_FORMAT_VORBIS) {
+   if (info->segment == 0) MSG("no checksums for lossy file %s\n", info->path);
+ } else if (crc_block > 0) {
+   char crc_path[PATH_MAX];
+   snprintf(crc_path, sizeof(crc_path), "%s.crc32c", info->path);
+   if ((info->crc_file = fopen(crc_path, "w")) == NULL) {
+     ERR("cannot open checksum file \"%s\" (%s)\n", crc_path, strerror(errno));
+     status = EIO;
+   } else {
+     fprintf(info->crc_file, "# crc32c block=%lld channels=%i sample=int32\n",
+             (long long) crc_block, info->channels);
+     info->crc = ~0U;
+     info->crc_frames = 0;
+     info->crc_blocks = 0;
+   }
  }
- info->ring = jack_ringbuffer_create(sample_size * ring_size);
- memset(info->ring->buf, 0, info->ring->size);
- info->state->can_read = 0;
- pthread_create(&info->thread_id, NULL, reader_thread, info);
+ if (bwf && !status)
+   status = set_bext(info);
+ if (!status) {
+   sf_command(info->file, SFC_UPDATE_HEADER_NOW, NULL, 0);
+   info->data_offset = file_size(info->path);
+   if (index_secs > 0) status = open_index(info);
+ }
+ if (status) close_sink(info);
  return status;
 }
 
-// Same purpose as the previous function but for the reader thread. Opens a (multichannel) WAV file to read from, creates a ringbuffer, and touches all its memory.
+// Open an output file, and with -T, -C and -X the timestamp, checksum and index sidecars next to it. Lossily compressed files cannot be checked sample for sample, so they get no checksums. If any of them cannot be opened, the file and the sidecars already open are closed again.
 
-// Similarites between these two functions could probably be extracted into a general setup_io_thread() function.
+static void segment_name(recap_io_info_t* info) {
+ const char* ext = strrchr(info->base_path, '.');
+ const char* slash = strrchr(info->base_path, '/');
+ if (ext == NULL || (slash != NULL && ext < slash)) ext = info->base_path + strlen(info->base_path);
+ snprintf(info->segment_path, sizeof(info->segment_path), "%.*s-%04ld%s",
+          (int) (ext - info->base_path), info->base_path, info->segment, ext);
+ info->path = info->segment_path;
+}
 
-static int run_io_thread(recap_io_info_t* info) {
- int* status;
- int ret;
- pthread_join(info->thread_id, (void**) &status);
- if (status == PTHREAD_CANCELED) {
-   ret = EPIPE;
- } else {
-   ret = *status;
-   free(status);
+static int rotate_sink(recap_io_info_t* info) {
+ recap_stamps_t* stamps = info->stamps;
+ flush_stamps(info);
+ close_sink(info);
+ info->segment_start += info->frames;
+ ++info->segment;
+ segment_name(info);
+ if (stamps->have_first) {
+   stamps->first_realtime_ns = stamps->last_realtime_ns +
+     (info->segment_start - stamps->last.frame) * 1000000000LL / info->rate;
+   stamps->first.frame = info->segment_start;
  }
- return ret;
+ return open_sink(info);
 }
 
-// Joins to a thread and returns its exit status.
-
-// Port registration and connection
+// With -R the capture is split into files of rotate_secs each, outfile-0000.wav, outfile-0001.wav and so on, each with its own sidecars, so that a capture running for days can be moved off the disk as it goes. The split is sample exact: each file carries on from the frame the last one ended on. The start time of each file after the first is extrapolated from the latest timestamp.
 
-static jack_port_t* register_port(char* name, int flags) {
-  jack_port_t* port;
-  if ((port = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, flags, 0)) == 0) {
-    DEBUG("cannot register port \"%s\"\n", name);
-    jack_client_close(client);
-    exit(1);
-  }
-  return port;
+static sf_count_t write_frames(recap_io_info_t* info, int* buf, sf_count_t nframes, int channels) {
+ sf_count_t written = 0;
+ while (written < nframes) {
+   sf_count_t take = nframes - written;
+   if (info->segment_frames > 0) {
+     if (info->frames == info->segment_frames && rotate_sink(info)) break;
+     if (take > info->segment_frames - info->frames) take = info->segment_frames - info->frames;
+   }
+   if (info->index_file) {
+     if (info->frames == info->next_index) index_entry(info, channels);
+     if (take > info->next_index - info->frames) take = info->next_index - info->frames;
+   }
+   if (info->crc_file)
+     crc_frames(info, (char*) (buf + written * channels), take, channels * sizeof(int));
+   sf_count_t count = sf_writef_int(info->file, buf + written * channels, take);
+   info->frames += count;
+   written += count;
+   if (count < take) break;
+ }
+ return written;
 }
 
-// Register the named port with the jack process. 
+// Write frames to the output, stopping at each indexed frame to enter it in the index, and at the end of each segment to move on to the next file.
+// Parallel decoding
 
-static void connect(const char* out, const char* in) {
- if (jack_connect(client, out, in)) {
-   DEBUG("cannot connect port \"%s\" to \"%s\"\n", out, in);
-   jack_client_close(client);
-   exit(1);
+typedef struct _recap_decode_arg {
+ recap_decoder_t* decoder;
+ int index;
+} recap_decode_arg_t;
+
+static void* decoder_thread(void* arg) {
+ recap_decoder_t* dec = ((recap_decode_arg_t*) arg)->decoder;
+ SNDFILE* file = dec->file[((recap_decode_arg_t*) arg)->index];
+ free(arg);
+ while (1) {
+   long chunk = atomic_fetch_add(&dec->next_chunk, 1);
+   if (chunk >= dec->chunks) break;
+   recap_block_t* block = &dec->block[chunk % dec->blocks];
+   pthread_mutex_lock(&dec->lock);
+   while (block->chunk != chunk && !dec->stop)
+     pthread_cond_wait(&dec->cond, &dec->lock);
+   pthread_mutex_unlock(&dec->lock);
+   if (dec->stop) break;
+
+   sf_count_t start = chunk * DECODE_CHUNK;
+   sf_count_t want = dec->length - start < DECODE_CHUNK ? dec->length - start : DECODE_CHUNK;
+   sf_count_t frames = 0;
+   if (sf_seek(file, start, SEEK_SET) == start)
+     frames = sf_readf_float(file, block->data, want);
+
+   pthread_mutex_lock(&dec->lock);
+   block->frames = frames;
+   block->ready = 1;
+   if (frames < want) dec->status = EIO;
+   pthread_cond_broadcast(&dec->cond);
+   pthread_mutex_unlock(&dec->lock);
  }
+ return NULL;
 }
 
-static void connect_ports(char** in_names, char** out_names) {
- int i;
- char* s;
- for (i = 0; i < channel_count_w; i++) {
-   char prt[32];
-   sprintf(prt, "recapture:input_%i", i);
-   char* shrt = prt + strlen("recapture:");
-   register_port(shrt, JackPortIsInput);
-   recap_in_ports[i] = jack_port_by_name(client, prt);
-   if ((s = in_names[i]) != NULL) connect(s, prt);
- }
- recap_in_ports[i] = NULL;
- for (i = 0; i < channel_count_r; i++) {
-   char prt[32];
-   sprintf(prt, "recapture:output_%i", i);
-   char* shrt = prt + strlen("recapture:");
-   register_port(shrt, JackPortIsOutput);
-   recap_out_ports[i] = jack_port_by_name(client, prt);
-   if ((s = out_names[i]) != NULL) connect(prt, s);
- }
- recap_out_ports[i] = NULL;
-}
-
-// Initialize recap_in_ports and recap_out_ports with this client?s in and out ports, and connect them to the supplied jack ports.
-// Set callbacks and handlers
-
-static void set_handlers(jack_client_t* client, recap_process_info_t* info) {
- jack_set_process_callback(client, process, info);
- jack_on_shutdown(client, jack_shutdown, info);
- signal(SIGQUIT, signal_handler);
- signal(SIGTERM, signal_handler);
- signal(SIGHUP, signal_handler);
- signal(SIGINT, signal_handler);
+// Each decoding thread seeks its own handle to the start of its chunk, which libsndfile does sample accurately for FLAC and Ogg by way of the nearest seek point, so the chunks decode independently of each other.
+
+static sf_count_t decoder_read(recap_decoder_t* dec, float* buf, sf_count_t nframes) {
+ int channels = dec->info->channels;
+ sf_count_t count = 0;
+ pthread_mutex_lock(&dec->lock);
+ while (count < nframes && dec->consumed < dec->chunks && dec->status == 0) {
+   recap_block_t* block = &dec->block[dec->consumed % dec->blocks];
+   if (!block->ready) {
+     pthread_cond_wait(&dec->cond, &dec->lock);
+     continue;
+   }
+   sf_count_t take = block->frames - dec->offset;
+   if (take > nframes - count) take = nframes - count;
+   memcpy(buf + count * channels, block->data + dec->offset * channels, take * channels * sizeof(float));
+   count += take;
+   dec->offset += take;
+   if (dec->offset == block->frames) {
+     block->ready = 0;
+     block->chunk = dec->consumed + dec->blocks;
+     dec->consumed++;
+     dec->offset = 0;
+     pthread_cond_broadcast(&dec->cond);
+   }
+ }
+ pthread_mutex_unlock(&dec->lock);
+ return count;
 }
 
-// Set jack callbacks and signal handlers.
-// Run jack client
-
-static int run_client(jack_client_t* client, recap_process_info_t* info) {
- recap_state_t* state = info->state;
-
- state->can_play    = 1;
- state->can_capture = 1;
- state->can_read    = 1;
+// Read decoded frames in file order, waiting for the decoding threads if they have not got that far yet. Like sf_readf_float() it only returns fewer frames than asked for at the end of the file, or on error, and a block is handed back to the decoding threads as soon as it has been emptied.
 
- int reader_status = run_io_thread(info->reader_info);
- int writer_status = run_io_thread(info->writer_info);
- int other_status = 0;
+static void decoder_free(recap_decoder_t* dec) {
+ int i;
+ if (dec == NULL) return;
+ pthread_mutex_lock(&dec->lock);
+ dec->stop = 1;
+ pthread_cond_broadcast(&dec->cond);
+ pthread_mutex_unlock(&dec->lock);
+ for (i = 0; i < dec->threads; i++) {
+   pthread_join(dec->thread_id[i], NULL);
+   sf_close(dec->file[i]);
+ }
+ for (i = 0; i < dec->blocks; i++)
+   free(dec->block[i].data);
+ free(dec);
+}
 
- if (info->overruns > 0) {
-   ERR("recapture failed with %ld overruns.\n", info->overruns);
-   ERR("try a bigger buffer than -b %" PRIu32 ".\n", ring_size);
-   other_status = EPIPE;
+static recap_decoder_t* decoder_new(recap_io_info_t* info, sf_count_t length, int threads) {
+ recap_decoder_t* dec = (recap_decoder_t*) calloc(1, sizeof(recap_decoder_t));
+ int i;
+ dec->info = info;
+ dec->length = length;
+ dec->chunks = (length + DECODE_CHUNK - 1) / DECODE_CHUNK;
+ dec->blocks = 2 * threads;
+ pthread_mutex_init(&dec->lock, NULL);
+ pthread_cond_init(&dec->cond, NULL);
+ atomic_init(&dec->next_chunk, 0);
+ for (i = 0; i < dec->blocks; i++) {
+   size_t size = DECODE_CHUNK * info->channels * sizeof(float);
+   dec->block[i].data = (float*) malloc(size);
+   memset(dec->block[i].data, 0, size);
+   dec->block[i].chunk = i;
  }
- long underruns = info->underruns + info->reader_info->underruns;
- if (underruns > 0) {
-   ERR("recapture failed with %ld underruns.\n", underruns);
-   ERR("try a bigger buffer than -b %" PRIu32 ".\n", ring_size);
-   other_status = EPIPE;
+ for (i = 0; i < threads; i++) {
+   SF_INFO sf_info;
+   sf_info.format = 0;
+   if ((dec->file[i] = sf_open(info->path, SFM_READ, &sf_info)) == NULL) {
+     ERR("cannot read sndfile: %s\n", info->path);
+     decoder_free(dec);
+     return NULL;
+   }
+   recap_decode_arg_t* arg = (recap_decode_arg_t*) malloc(sizeof(recap_decode_arg_t));
+   arg->decoder = dec;
+   arg->index = i;
+   pthread_create(&dec->thread_id[i], NULL, decoder_thread, arg);
+   dec->threads = i + 1;
  }
- return reader_status || writer_status || other_status;
+ return dec;
 }
 
-// Run reader and writer threads, and return their status.
+// Open a handle on the file for each decoding thread and start them. The blocks are allocated and touched up front, and decoding starts at once so that the first blocks are ready by the time the reader prefills its ring.
+// Thread implementation
 
-// Looks like can_play, can_capture, and can_read could be collapsed in to one field.
-// Argument parsing
+static int reader_can_run(recap_io_info_t* info) {
+ return state_phase(info->state) != DONE;
+}
 
-static void split_names(char* str, char** list) {
- int i = 0;
- char* s = strtok(str, ",");
- while (s != NULL) {
+static int writer_can_run(recap_io_info_t* info) {
+ return state_phase(info->state) >= RUNNING;
+}
+
+static int reader_is_done(recap_io_info_t* info) {
+ return 0;
+}
+
+static int writer_is_done(recap_io_info_t* info) {
+ return state_phase(info->state) >= DRAINING &&
+   jack_ringbuffer_read_space(info->ring) == 0;
+}
+
+static size_t reader_space(recap_io_info_t* info) {
+ return jack_ringbuffer_write_space(info->ring);
+}
+
+static size_t writer_space(recap_io_info_t* info) {
+ return jack_ringbuffer_read_space(info->ring);
+}
+
+// Read and write implementations of the above typedefs.
+
+static int reader_wants_wake(recap_io_info_t* info) {
+ return !(state_load(info->state) & RECAP_EOF(info->index)) &&
+   jack_ringbuffer_write_space(info->ring) >= info->wake_space;
+}
+
+static int writer_wants_wake(recap_io_info_t* info) {
+ return state_phase(info->state) >= DRAINING ||
+   jack_ringbuffer_read_space(info->ring) >= info->wake_space;
+}
+
+// Wakeup hysteresis. Signalling both threads every cycle means that at small periods they wake hundreds of times a second to move a few frames each. Instead the writer is only woken once the capture ring has filled past the watermark, and the reader once the playback ring has drained below it, so each wakeup moves a large batch and the disk sees large sequential IO. Once playback is DRAINING the writer is woken every cycle so that it drains what is left and exits.
+
+static int reader_ready(recap_io_info_t* info) {
+ return reader_can_run(info) && reader_wants_wake(info);
+}
+
+static int writer_ready(recap_io_info_t* info) {
+ return writer_can_run(info) && writer_wants_wake(info);
+}
+
+// The same conditions as seen from the IO threads themselves, used when spinning.
+
+static void reader_primed(recap_io_info_t* info, int reader_count) {
+ unsigned all = RECAP_PRIMED(reader_count) - RECAP_PRIMED(0);
+ state_raise(info->state, RECAP_PRIMED(info->index));
+ if ((state_load(info->state) & all) == all)
+   state_advance(info->state, IDLE, PREFILLED);
+}
+
+// Each reader marks itself primed after its first fill, and whichever is last moves the session on to PREFILLED, so every file starts playing on the same frame.
+
+static void writer_drained(recap_io_info_t* info, int writer_count) {
+ unsigned all = RECAP_DRAINED(writer_count) - RECAP_DRAINED(0);
+ state_raise(info->state, RECAP_DRAINED(info->index));
+ if ((state_load(info->state) & all) == all)
+   state_advance(info->state, DRAINING, DONE);
+}
+
+// Likewise the last writer to finish marks the session DONE.
+
+static sf_count_t loop_read(recap_io_info_t* info, float* buf, sf_count_t nframes) {
+ int channels = info->channels;
+ sf_count_t fade = info->loop_fade;
+ sf_count_t period = info->loop_length - fade;
+ sf_count_t count = 0;
+ while (count < nframes) {
+   sf_count_t repeat = info->loop_pos / period;
+   sf_count_t offset = info->loop_pos % period;
+   sf_count_t run;
+   float* out = buf + count * channels;
+   if (info->loop_end == 0 && atomic_load_explicit(&info->loop_stop, memory_order_relaxed))
+     info->loop_end = repeat + 1;
+   if ((loop_count > 0 && repeat == loop_count) || (info->loop_end > 0 && repeat == info->loop_end)) {
+     if (offset >= fade) break;
+     run = fade - offset < nframes - count ? fade - offset : nframes - count;
+     memcpy(out, info->loop_data + (period + offset) * channels, run * channels * sizeof(float));
+   } else if (repeat > 0 && offset < fade) {
+     sf_count_t i;
+     int c;
+     run = fade - offset < nframes - count ? fade - offset : nframes - count;
+     for (i = 0; i < run; i++) {
+       float in = 0.5f - 0.5f * cosf(M_PI * (offset + i + 0.5f) / fade);
+       const float* head = info->loop_data + (offset + i) * channels;
+       const float* tail = info->loop_data + (period + offset + i) * channels;
+       for (c = 0; c < channels; c++)
+         out[i * channels + c] = in * head[c] + (1.0f - in) * tail[c];
+     }
+   } else {
+     run = period - offset < nframes - count ? period - offset : nframes - count;
+     memcpy(out, info->loop_data + offset * channels, run * channels * sizeof(float));
+   }
+   count += run;
+   info->loop_pos += run;
+ }
+ return count;
+}
+
+// Play the preloaded file loop_count times over, or for ever. Each repeat starts on the frame after the last one ended, so the loop is sample exact. With a crossfade the last loop_fade frames of one repeat are faded out over the first loop_fade frames of the next, with gains that add up to one, and only the last repeat plays its tail at full level. Like sf_readf_float() this only returns fewer frames than asked for at the end. A loop asked to stop finishes the repeat it is on.
+
+static int reader_body(void* buf, size_t space, recap_io_info_t* info) {
+ int status = 0;
+ sf_count_t nframes = space / info->frame_size;
+ sf_count_t frame_count;
+ if (info->loop_data)
+   frame_count = loop_read(info, buf, nframes);
+ else if (info->decoder)
+   frame_count = decoder_read(info->decoder, buf, nframes);
+ else
+   frame_count = sf_readf_float(info->file, buf, nframes);
+ if (info->decoder && info->decoder->status) {
+   ERR("cannot decode sndfile: %s\n", info->path);
+   state_raise(info->state, RECAP_EOF(info->index));
+   status = EIO;
+ } else if (frame_count == 0) {
+   DEBUG("reached end of sndfile: %s\n", info->path);
+   state_raise(info->state, RECAP_EOF(info->index));
+   status = FINISHED;
+ } else if (info->underfill > 0) {
+   ERR("cannot read sndfile: %s\n", info->path);
+   state_raise(info->state, RECAP_EOF(info->index));
+   status = EIO;
+ } else {
+   sf_count_t size = frame_count * info->frame_size;
+   if (jack_ringbuffer_write(info->ring, buf, size) < size) {
+     ++info->underruns;
+     ERR("reader thread: buffer underrun\n");
+   }
+   info->frames += frame_count;
+   DEBUG("read %6ld frames\n", (long int) frame_count);
+   if (frame_count < nframes && info->underfill == 0) {
+     DEBUG("expected %ld frames but only read %ld,\n", (long int) nframes, (long int) frame_count);
+     DEBUG("wait for one cycle to make sure.\n");
+     ++info->underfill;
+   }
+ }
+ reader_primed(info, proc_info->reader_count);
+ return status;
+}
+
+// Reader implementation of io_body_fn. It is impossible to tell if the first underfill is caused by IO problems or by reaching the end of the sound file. If the frame count for the following cycle is zero, it is assumed that the end of the file has been reached; otherwise if underfill is greater than zero it must be an IO issue so the thread exits.
+
+// Looping files are played from memory, and compressed files are read through their decoder, which has usually decoded the frames already. The first pass through this function fills the whole ring, after which the reader is primed. Errors also raise RECAP_EOF so that playback drains instead of underrunning forever.
+
+static int write_block(recap_io_info_t* info, void* buf, sf_count_t nframes) {
+ pcm_from_float(buf, nframes * info->channels, sample_bits(info->format));
+ flush_stamps(info);
+ if (write_frames(info, buf, nframes, info->channels) < nframes) {
+   ERR("cannot write sndfile (%s)\n", sf_strerror(info->file));
+   return EIO;
+ }
+ return 0;
+}
+
+static int writer_body(void* buf, size_t space, recap_io_info_t* info) {
+ sf_count_t nframes = space / info->frame_size;
+ jack_ringbuffer_read(info->ring, buf, nframes * info->frame_size);
+ DEBUG("wrote %5ld frames\n", (long int) nframes);
+ if (info->resampler) {
+   if (drift_lock)
+     info->resampler->step = info->resampler->nominal *
+       (1.0 + atomic_load_explicit(&proc_info->drift_ppb, memory_order_relaxed) * 1e-9);
+   nframes = resample(info->resampler, buf, nframes);
+   buf = info->resampler->out;
+ }
+ return write_block(info, buf, nframes);
+}
+
+// Writer implementatino of io_body_fn. Only whole frames are taken from the ring: the jack thread may be part way through writing one, and reading its first samples would shift every following frame by a channel. Frames for a file at another sample rate than jack's go through the resampler first.
+
+static int reader_thread_fn(recap_io_info_t* info) {
+ return io_thread(&reader_can_run, &reader_is_done,
+                  &reader_space, &reader_body, info);
+}
+
+static int writer_thread_fn(recap_io_info_t* info) {
+ int status = io_thread(&writer_can_run, &writer_is_done,
+                        &writer_space, &writer_body, info);
+ if (status == FINISHED) {
+   if (info->resampler &&
+       write_block(info, info->resampler->out, resample_flush(info->resampler)))
+     status = EIO;
+   writer_drained(info, proc_info->writer_count);
+ }
+ return status;
+}
+
+// Read and write implementations of io_thread_fn. Due to the earlier abstraction these definitions are simple. The writers are the last threads to finish, so they are the ones to mark the session DONE.
+
+static void io_cleanup(void* arg) {
+ recap_io_info_t* info = (recap_io_info_t*) arg;
+ decoder_free(info->decoder);
+ info->decoder = NULL;
+ if (info->file) sf_close(info->file);
+}
+
+static void writer_cleanup(void* arg) {
+ recap_io_info_t* info = (recap_io_info_t*) arg;
+ flush_stamps(info);
+ close_sink(info);
+}
+
+static void io_free(recap_io_info_t* info) {
+ if (info->ring) jack_ringbuffer_free(info->ring);
+ free(info->stamps);
+ free(info->loop_data);
+ free(info->sweep);
+ free(info->tone);
+ resampler_free(info->resampler);
+}
+
+// io_cleanup() closes a reader's file, and stops its decoding threads, when it has finished, and writer_cleanup() a writer's, which first writes out the remaining timestamps and checksums and completes the broadcast wave header. io_free() is used at the end of main() to free resources which the jack thread may still be using after the IO threads exit.
+
+// IO worker pool
+
+typedef double (*io_urgency_fn) (recap_io_info_t*);
+
+typedef struct _recap_stream_ops {
+ io_thread_fn run;
+ io_test_fn ready;
+ io_urgency_fn urgency;
+ cleanup_fn cleanup;
+} recap_stream_ops_t;
+
+static double reader_urgency(recap_io_info_t* info) {
+ return (double) jack_ringbuffer_write_space(info->ring) / info->ring->size;
+}
+
+static double writer_urgency(recap_io_info_t* info) {
+ return (double) jack_ringbuffer_read_space(info->ring) / info->ring->size;
+}
+
+static const recap_stream_ops_t reader_ops = {
+ &reader_thread_fn, &reader_ready, &reader_urgency, &io_cleanup
+};
+
+static const recap_stream_ops_t writer_ops = {
+ &writer_thread_fn, &writer_ready, &writer_urgency, &writer_cleanup
+};
+
+// The urgency of a stream is how close its ring is to running dry, for a reader, or to overflowing, for a writer, from 0 to 1.
+
+static int stream_count(recap_process_info_t* info) {
+ return info->reader_count + info->sink_count;
+}
+
+static recap_io_info_t* stream_at(recap_process_info_t* info, int n) {
+ return n < info->reader_count ? &info->readers[n] : &info->writers[n - info->reader_count];
+}
+
+// The readers and writers taken together as one list of streams.
+
+#define HOME_BIAS 0.25
+
+static recap_io_info_t* claim_stream(recap_worker_t* worker) {
+ recap_io_info_t* best = NULL;
+ double best_urgency = -1.0;
+ int n;
+ for (n = 0; n < stream_count(proc_info); n++) {
+   recap_io_info_t* stream = stream_at(proc_info, n);
+   if (atomic_load_explicit(&stream->claimed, memory_order_relaxed) || !stream->ops->ready(stream))
+     continue;
+   double urgency = stream->ops->urgency(stream);
+   if (stream->home == worker->index) urgency += HOME_BIAS;
+   if (urgency > best_urgency) {
+     best = stream;
+     best_urgency = urgency;
+   }
+ }
+ int unclaimed = 0;
+ if (best == NULL || !atomic_compare_exchange_strong(&best->claimed, &unclaimed, worker->index + 1))
+   return NULL;
+ if (best->home != worker->index) ++worker->steals;
+ return best;
+}
+
+// Pick the most urgent stream that has work to do and claim it. A worker's own streams are favoured by HOME_BIAS, so it only takes over another worker's stream when that is clearly in more danger, which is the case when its home worker is busy. If another worker claims the stream first this one simply looks again.
+
+static int pool_has_work(recap_worker_t* worker) {
+ int n;
+ if (atomic_load(&proc_info->streams_left) == 0) return 1;
+ for (n = 0; n < stream_count(proc_info); n++) {
+   recap_io_info_t* stream = stream_at(proc_info, n);
+   if (!atomic_load_explicit(&stream->claimed, memory_order_relaxed) && stream->ops->ready(stream))
+     return 1;
+ }
+ return 0;
+}
+
+// A worker has something to do if any stream is ready, or if every stream has finished and it is time to exit.
+
+static void wait_for_work(recap_worker_t* worker) {
+ if (spin_usecs > 0) {
+   struct timespec start;
+   pthread_mutex_unlock(&worker->lock);
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   while (!pool_has_work(worker) && elapsed_usecs(&start) < spin_usecs)
+     cpu_relax();
+   pthread_mutex_lock(&worker->lock);
+   if (pool_has_work(worker)) {
+     ++worker->spin_hits;
+     return;
+   }
+ }
+ ++worker->parks;
+ pthread_cond_wait(&worker->cond, &worker->lock);
+}
+
+// Opt-in spin-then-park waiting. For tiny rings at tiny periods the futex round trip of a condition variable wakeup adds jitter, so with spin_usecs set a worker first polls the ring levels (pausing the cpu between polls) for a bounded time and only parks if no work turned up. The final check is made with the lock held, so a signal sent after it cannot be lost. This burns a core and is meant for machines with cores to spare.
+
+static void stream_cleanup(recap_io_info_t* stream) {
+ if (atomic_exchange(&stream->cleaned, 1) == 0)
+   stream->ops->cleanup(stream);
+}
+
+static void wake_workers(recap_worker_t* self) {
+ int i;
+ for (i = 0; i < proc_info->worker_count; i++) {
+   recap_worker_t* worker = &proc_info->workers[i];
+   if (worker == self) continue;
+   pthread_mutex_lock(&worker->lock);
+   pthread_cond_signal(&worker->cond);
+   pthread_mutex_unlock(&worker->lock);
+ }
+}
+
+static void run_stream(recap_worker_t* worker, recap_io_info_t* stream) {
+ int status = stream->ops->run(stream);
+ if (status == 0) {
+   atomic_store_explicit(&stream->claimed, 0, memory_order_release);
+   return;
+ }
+ stream->status = status == FINISHED ? 0 : status;
+ stream_cleanup(stream);
+ if (atomic_fetch_sub(&proc_info->streams_left, 1) == 1)
+   wake_workers(worker);
+}
+
+// Serve a claimed stream once and release it. A stream that has finished, or failed, is closed and stays claimed, and whoever finishes the last stream wakes the other workers so that they exit.
+
+static void worker_cleanup(void* arg) {
+ recap_worker_t* worker = (recap_worker_t*) arg;
+ int n;
+ for (n = 0; n < stream_count(proc_info); n++) {
+   recap_io_info_t* stream = stream_at(proc_info, n);
+   int unclaimed = 0;
+   if (atomic_load(&stream->claimed) == worker->index + 1 ||
+       atomic_compare_exchange_strong(&stream->claimed, &unclaimed, worker->index + 1))
+     stream_cleanup(stream);
+ }
+}
+
+// When a worker is cancelled it closes the stream it was serving and any stream nobody is serving, so that every file is closed, and its sidecars finished, exactly once whichever workers are cancelled first.
+
+static void* worker_thread(void* arg) {
+ recap_worker_t* worker = (recap_worker_t*) arg;
+ pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+ pthread_cleanup_push(worker_cleanup, arg);
+ pthread_mutex_lock(&worker->lock);
+ while (atomic_load(&proc_info->streams_left) > 0) {
+   recap_io_info_t* stream = claim_stream(worker);
+   if (stream != NULL)
+     run_stream(worker, stream);
+   else
+     wait_for_work(worker);
+ }
+ pthread_mutex_unlock(&worker->lock);
+ pthread_exit(NULL);
+ pthread_cleanup_pop(1);
+}
+
+// The worker loop. A worker holds its lock while it is serving streams and only lets go of it to wait for work.
+
+static void wake_stream(recap_process_info_t* info, recap_io_info_t* stream) {
+ int i;
+ if (atomic_load_explicit(&stream->claimed, memory_order_relaxed)) return;
+ for (i = 0; i < info->worker_count; i++) {
+   recap_worker_t* worker = &info->workers[(stream->home + i) % info->worker_count];
+   if (pthread_mutex_trylock(&worker->lock) == 0) {
+     pthread_cond_signal(&worker->cond);
+     pthread_mutex_unlock(&worker->lock);
+     return;
+   }
+ }
+}
+
+// Signal a worker from the jack thread. A worker that holds its lock is busy and will look at every ring again before sleeping, so there is no need to wait for the lock; the next worker is tried instead, and the stream's home worker first. That way a stream whose home worker is stuck on a slow write is picked up by one that is idle.
+
+static size_t wake_threshold(jack_ringbuffer_t* ring, size_t frame_size) {
+ size_t space = (ring->size - 1) / 100 * wake_percent;
+ space -= space % frame_size;
+ return space > frame_size ? space : frame_size;
+}
+
+// Convert wake_percent into a whole number of frames worth of ring bytes. jack rounds ring sizes up to a power of two, so this is computed from the ring itself rather than ring_size.
+// Fourier transform
+
+typedef struct _recap_fft {
+ int size;
+ int* reverse;
+ float* twiddle_re;
+ float* twiddle_im;
+} recap_fft_t;
+
+// An in place radix-2 complex FFT of size points, a power of two. The real and imaginary parts are kept in separate arrays and the twiddle factors of each stage are stored one after the other, those of the stage of span h starting at h - 1, so the butterflies read everything contiguously and are computed four at a time with SSE2 once the span reaches four.
+
+static recap_fft_t* fft_new(int size) {
+ recap_fft_t* fft = (recap_fft_t*) calloc(1, sizeof(recap_fft_t));
+ int bits = 0;
+ int i, h;
+ while ((1 << bits) < size) bits++;
+ fft->size = size;
+ fft->reverse = (int*) calloc(size, sizeof(int));
+ fft->twiddle_re = (float*) calloc(size, sizeof(float));
+ fft->twiddle_im = (float*) calloc(size, sizeof(float));
+ for (i = 0; i < size; i++) {
+   int j, r = 0;
+   for (j = 0; j < bits; j++)
+     r |= ((i >> j) & 1) << (bits - 1 - j);
+   fft->reverse[i] = r;
+ }
+ for (h = 1; h < size; h *= 2) {
+   for (i = 0; i < h; i++) {
+     fft->twiddle_re[h - 1 + i] = (float) cos(M_PI * i / h);
+     fft->twiddle_im[h - 1 + i] = (float) -sin(M_PI * i / h);
+   }
+ }
+ return fft;
+}
+
+static void fft_free(recap_fft_t* fft) {
+ if (fft == NULL) return;
+ free(fft->reverse);
+ free(fft->twiddle_re);
+ free(fft->twiddle_im);
+ free(fft);
+}
+
+static void fft_forward(recap_fft_t* fft, float* re, float* im) {
+ int n = fft->size;
+ int i, h, start;
+ for (i = 0; i < n; i++) {
+   int r = fft->reverse[i];
+   if (r > i) {
+     float t = re[i]; re[i] = re[r]; re[r] = t;
+     t = im[i]; im[i] = im[r]; im[r] = t;
+   }
+ }
+ for (h = 1; h < n; h *= 2) {
+   const float* wr = fft->twiddle_re + h - 1;
+   const float* wi = fft->twiddle_im + h - 1;
+   for (start = 0; start < n; start += 2 * h) {
+     float* ar = re + start;
+     float* ai = im + start;
+     float* br = ar + h;
+     float* bi = ai + h;
+     i = 0;
+#if defined(__x86_64__)
+     for (; i + 4 <= h; i += 4) {
+       __m128 xr = _mm_loadu_ps(br + i);
+       __m128 xi = _mm_loadu_ps(bi + i);
+       __m128 cr = _mm_loadu_ps(wr + i);
+       __m128 ci = _mm_loadu_ps(wi + i);
+       __m128 tr = _mm_sub_ps(_mm_mul_ps(xr, cr), _mm_mul_ps(xi, ci));
+       __m128 ti = _mm_add_ps(_mm_mul_ps(xr, ci), _mm_mul_ps(xi, cr));
+       __m128 yr = _mm_loadu_ps(ar + i);
+       __m128 yi = _mm_loadu_ps(ai + i);
+       _mm_storeu_ps(br + i, _mm_sub_ps(yr, tr));
+       _mm_storeu_ps(bi + i, _mm_sub_ps(yi, ti));
+       _mm_storeu_ps(ar + i, _mm_add_ps(yr, tr));
+       _mm_storeu_ps(ai + i, _mm_add_ps(yi, ti));
+     }
+#endif
+     for (; i < h; i++) {
+       float tr = br[i] * wr[i] - bi[i] * wi[i];
+       float ti = br[i] * wi[i] + bi[i] * wr[i];
+       br[i] = ar[i] - tr;
+       bi[i] = ai[i] - ti;
+       ar[i] += tr;
+       ai[i] += ti;
+     }
+   }
+ }
+}
+
+static void fft_inverse(recap_fft_t* fft, float* re, float* im) {
+ float scale = 1.0f / fft->size;
+ int i;
+ for (i = 0; i < fft->size; i++)
+   im[i] = -im[i];
+ fft_forward(fft, re, im);
+ for (i = 0; i < fft->size; i++) {
+   re[i] *= scale;
+   im[i] *= -scale;
+ }
+}
+
+// Bit reverse the input, then combine transforms of span h into ones of span 2h. The inverse transform is the forward one of the complex conjugate, conjugated again and scaled.
+
+static void fft_split(int n, const float* re, const float* im, int k, float x[2], float y[2]) {
+ int m = (n - k) % n;
+ x[0] = 0.5f * (re[k] + re[m]);
+ x[1] = 0.5f * (im[k] - im[m]);
+ y[0] = 0.5f * (im[k] + im[m]);
+ y[1] = 0.5f * (re[m] - re[k]);
+}
+
+// Two real signals are transformed at once by putting one in the real part and the other in the imaginary part. fft_split() separates bin k of the two spectra again, using the symmetry of the transform of a real signal.
+// Sweeps
+
+static int parse_sweep(const char* path, recap_sweep_t* sweep) {
+ char tail;
+ if (strncmp(path, "noise:", 6) == 0) {
+   sweep->noise = 1;
+   if (sscanf(path, "noise:%lf%c", &sweep->secs, &tail) != 1 || sweep->secs <= 0.0) {
+     ERR("noise is given as noise:secs, not %s\n", path);
+     return EINVAL;
+   }
+   return 0;
+ }
+ if (sscanf(path, "sweep:%lf:%lf:%lf%c", &sweep->low, &sweep->high, &sweep->secs, &tail) != 3 ||
+     sweep->low <= 0.0 || sweep->high <= sweep->low || sweep->secs <= 0.0) {
+   ERR("a sweep is given as sweep:low:high:secs, not %s\n", path);
+   return EINVAL;
+ }
+ return 0;
+}
+
+static void render_sweep(recap_sweep_t* sweep, float* out, int stride) {
+ double rate_log = log(sweep->high / sweep->low);
+ double scale = 2.0 * M_PI * sweep->low * sweep->secs / rate_log;
+ sf_count_t fade = sweep->rate / 200;
+ uint32_t seed = 0x9e3779b9u;
+ sf_count_t i;
+ for (i = 0; i < sweep->length; i++) {
+   double t = (double) i / sweep->rate;
+   double value;
+   if (sweep->noise) {
+     seed ^= seed << 13;
+     seed ^= seed >> 17;
+     seed ^= seed << 5;
+     value = SWEEP_LEVEL * (seed / 2147483648.0 - 1.0);
+   } else {
+     value = SWEEP_LEVEL * sin(scale * (exp(t * rate_log / sweep->secs) - 1.0));
+   }
+   if (i < fade)
+     value *= 0.5 - 0.5 * cos(M_PI * i / fade);
+   else if (i >= sweep->length - fade)
+     value *= 0.5 - 0.5 * cos(M_PI * (sweep->length - 1 - i) / fade);
+   out[i * stride] = (float) value;
+ }
+}
+
+// An exponential sweep from low to high Hz over secs seconds, or secs of uniform white noise from a xorshift generator, faded in and out over 5 ms so it starts and stops without a click.
+
+static double tone_frequency(recap_tone_t* tone, int step) {
+ if (tone->steps == 1) return tone->low;
+ return tone->low * pow(tone->high / tone->low, (double) step / (tone->steps - 1));
+}
+
+// The frequency of a step of a stepped sine.
+
+// Analysis
+
+static void tap_frames(recap_analysis_t* an, recap_sample_t** in, recap_sample_t** out, jack_nframes_t nframes) {
+ jack_nframes_t i;
+ int k;
+ if (jack_ringbuffer_write_space(an->ring) < nframes * an->frame_size) {
+   ++an->overruns;
+   return;
+ }
+ for (i = 0; i < nframes; i++) {
+   float frame[2 * MAX_PORTS];
+   for (k = 0; k < an->played; k++)
+     frame[k] = out[k][i];
+   for (k = 0; k < an->captured; k++)
+     frame[an->played + k] = in[k][i];
+   jack_ringbuffer_write(an->ring, (char*) frame, an->frame_size);
+ }
+}
+
+// Called by the jack thread with the frames it captured this cycle and the frames played alongside them. If the analysis thread has fallen behind the whole cycle is left out rather than waiting, and the overrun makes the analysis fail.
+
+static void wake_analysis(recap_analysis_t* an, recap_status_t phase) {
+ if ((phase >= DRAINING || jack_ringbuffer_read_space(an->ring) >= an->wake_space) &&
+     pthread_mutex_trylock(&an->lock) == 0) {
+   pthread_cond_signal(&an->cond);
+   pthread_mutex_unlock(&an->lock);
+ }
+}
+
+// The analysis thread is woken the same way as the IO workers.
+
+static void analyse_block(recap_analysis_t* an, size_t nframes) {
+ int channels = an->played + an->captured;
+ size_t i;
+ int k;
+ jack_ringbuffer_read(an->ring, (char*) an->block, nframes * an->frame_size);
+ for (k = 0; k < channels; k++) {
+   float* channel = an->channel[k];
+   for (i = 0; i < nframes; i++)
+     channel[i] = an->block[i * channels + k];
+ }
+ for (k = 0; k < an->count; k++) {
+   recap_analyser_t* analyser = &an->analyser[k];
+   analyser->block(analyser, an->channel, an->channel + an->played, an->frames, nframes);
+ }
+ an->frames += nframes;
+}
+
+static int claim_job(recap_analysis_t* an, long generation, int count) {
+ unsigned long long next = atomic_load(&an->job_next);
+ while ((next >> 32) == (unsigned long long) (generation & 0xffffffff) && (int) (next & 0xffffffff) < count) {
+   if (atomic_compare_exchange_weak(&an->job_next, &next, next + 1))
+     return (int) (next & 0xffffffff);
+ }
+ return -1;
+}
+
+// Take the next index of the given generation, or -1 once they are all taken or a later generation has begun. The generation is compared in the same exchange that takes the index, so a helper that still has the job of an earlier batch cannot take an index of the next one.
+
+static void* helper_thread(void* arg) {
+ recap_analysis_t* an = (recap_analysis_t*) arg;
+ long seen = 0;
+ pthread_mutex_lock(&an->job_lock);
+ while (1) {
+   analysis_job_fn job;
+   void* job_arg;
+   int count, index, done = 0;
+   while (an->generation == seen && !an->stop)
+     pthread_cond_wait(&an->job_cond, &an->job_lock);
+   if (an->stop) break;
+   seen = an->generation;
+   job = an->job;
+   job_arg = an->job_arg;
+   count = an->job_count;
+   an->active++;
+   pthread_mutex_unlock(&an->job_lock);
+   while ((index = claim_job(an, seen, count)) >= 0) {
+     job(job_arg, index);
+     done++;
+   }
+   pthread_mutex_lock(&an->job_lock);
+   an->jobs_done += done;
+   an->active--;
+   pthread_cond_broadcast(&an->done_cond);
+ }
+ pthread_mutex_unlock(&an->job_lock);
+ return NULL;
+}
+
+static void run_jobs(recap_analysis_t* an, analysis_job_fn job, void* arg, int count) {
+ int index, done = 0;
+ if (an->helpers == 0 || count < 2) {
+   for (index = 0; index < count; index++)
+     job(arg, index);
+   return;
+ }
+ pthread_mutex_lock(&an->job_lock);
+ an->job = job;
+ an->job_arg = arg;
+ an->job_count = count;
+ an->jobs_done = 0;
+ an->generation++;
+ atomic_store(&an->job_next, (unsigned long long) (an->generation & 0xffffffff) << 32);
+ pthread_cond_broadcast(&an->job_cond);
+ pthread_mutex_unlock(&an->job_lock);
+ while ((index = claim_job(an, an->generation, count)) >= 0) {
+   job(arg, index);
+   done++;
+ }
+ pthread_mutex_lock(&an->job_lock);
+ an->jobs_done += done;
+ while (an->jobs_done < count || an->active > 0)
+   pthread_cond_wait(&an->done_cond, &an->job_lock);
+ pthread_mutex_unlock(&an->job_lock);
+}
+
+// Analysers that work on channels one at a time share the work out with run_jobs(), which runs job for every index below count on the analysis thread and its helpers and returns when all are done. Helpers take indexes from job_next as they become free. A helper counts itself active while it may still take an index, and run_jobs() waits for the helpers that are active to finish. A helper can still wake after run_jobs() has returned, the analysis thread having run every index itself, and pick up this batch's job; claim_job() then gives it nothing, whether or not the next batch has started.
+
+static void start_helpers(recap_analysis_t* an) {
+ int threads = analysis_threads > 0 ? analysis_threads : sysconf(_SC_NPROCESSORS_ONLN);
+ int i;
+ if (analysis_threads <= 0 && threads > 4) threads = 4;
+ if (threads > MAX_HELPERS + 1) threads = MAX_HELPERS + 1;
+ an->helpers = threads > 1 ? threads - 1 : 0;
+ for (i = 0; i < an->helpers; i++)
+   pthread_create(&an->helper_id[i], NULL, helper_thread, an);
+}
+
+static void stop_helpers(recap_analysis_t* an) {
+ int i;
+ pthread_mutex_lock(&an->job_lock);
+ an->stop = 1;
+ pthread_cond_broadcast(&an->job_cond);
+ pthread_mutex_unlock(&an->job_lock);
+ for (i = 0; i < an->helpers; i++)
+   pthread_join(an->helper_id[i], NULL);
+}
+
+// The analysis thread has up to four threads to share its work with by default, itself included, or as many as -A gives. The helpers stay for the finish functions and are stopped after them.
+
+static void* analysis_thread(void* arg) {
+ recap_analysis_t* an = (recap_analysis_t*) arg;
+ int k;
+ pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+ pthread_mutex_lock(&an->lock);
+ while (1) {
+   int draining = state_phase(an->state) >= DRAINING;
+   size_t nframes = jack_ringbuffer_read_space(an->ring) / an->frame_size;
+   if (nframes == 0) {
+     if (draining) break;
+     pthread_cond_wait(&an->cond, &an->lock);
+     continue;
+   }
+   if (nframes > ANALYSIS_BLOCK) nframes = ANALYSIS_BLOCK;
+   analyse_block(an, nframes);
+ }
+ pthread_mutex_unlock(&an->lock);
+ if (an->overruns > 0) {
+   ERR("analysis missed %ld cycles, try a bigger buffer than -b %" PRIu32 "\n", an->overruns, ring_size);
+   an->status = EPIPE;
+ }
+ for (k = 0; k < an->count; k++) {
+   an->status |= an->analyser[k].finish(&an->analyser[k]);
+   an->analyser[k].state = NULL;
+ }
+ stop_helpers(an);
+ return NULL;
+}
+
+// The analysis thread runs until the capture is over and the ring is empty. The phase is looked at before the ring, so that frames tapped before the session moved on to DRAINING are not missed.
+
+static jack_nframes_t path_latency(int out, int in) {
+ jack_latency_range_t playback, capture;
+ jack_port_get_latency_range(recap_out_ports[out], JackPlaybackLatency, &playback);
+ jack_port_get_latency_range(recap_in_ports[in], JackCaptureLatency, &capture);
+ return playback.max + capture.max;
+}
+
+// The round trip latency from output port out to input port in, as jack reports it once they are connected.
+
+static recap_analyser_t* add_analyser(recap_analysis_t* an, const char* name) {
+ recap_analyser_t* analyser;
+ if (an->count == MAX_ANALYSERS) {
+   ERR("too many analyses, %s makes %i of at most %i\n", name, an->count + 1, MAX_ANALYSERS);
+   return NULL;
+ }
+ analyser = &an->analyser[an->count++];
+ memset(analyser, 0, sizeof(*analyser));
+ analyser->name = name;
+ return analyser;
+}
+
+// MAX_ANALYSERS leaves room for one analyser of every kind, which is all the options can ask for.
+
+static recap_analysis_t* analysis_new(recap_state_t* state) {
+ recap_analysis_t* an = (recap_analysis_t*) calloc(1, sizeof(recap_analysis_t));
+ int k;
+ pthread_mutex_init(&an->lock, NULL);
+ pthread_cond_init(&an->cond, NULL);
+ pthread_mutex_init(&an->job_lock, NULL);
+ pthread_cond_init(&an->job_cond, NULL);
+ pthread_cond_init(&an->done_cond, NULL);
+ atomic_init(&an->job_next, 0);
+ an->state = state;
+ an->played = channel_count_r;
+ an->captured = channel_count_w;
+ an->frame_size = (an->played + an->captured) * sizeof(float);
+ an->ring = jack_ringbuffer_create(ring_size * an->frame_size);
+ memset(an->ring->buf, 0, an->ring->size);
+ an->wake_space = wake_threshold(an->ring, an->frame_size);
+ an->block = (float*) calloc(ANALYSIS_BLOCK * (an->played + an->captured), sizeof(float));
+ for (k = 0; k < an->played + an->captured; k++)
+   an->channel[k] = (float*) calloc(ANALYSIS_BLOCK, sizeof(float));
+ return an;
+}
+
+static void analysis_free(recap_analysis_t* an) {
+ int k;
+ if (an == NULL) return;
+ for (k = 0; k < an->count; k++) {
+   if (an->analyser[k].state) an->analyser[k].release(&an->analyser[k]);
+ }
+ jack_ringbuffer_free(an->ring);
+ free(an->block);
+ for (k = 0; k < an->played + an->captured; k++)
+   free(an->channel[k]);
+ free(an);
+}
+
+// The analysis ring holds ring_size frames of every played and captured channel, and is touched up front like the IO rings. Analysers that have not finished, because setup failed, an analyser failed to start or the analysis thread was cancelled, are released when the analysis is freed.
+
+static int start_analysis(recap_analysis_t* an) {
+ int status = 0;
+ int k;
+ for (k = 0; k < an->count; k++) {
+   if (an->analyser[k].start && (status = an->analyser[k].start(&an->analyser[k])) != 0)
+     return status;
+ }
+ start_helpers(an);
+ pthread_create(&an->thread_id, NULL, analysis_thread, an);
+ return 0;
+}
+
+// Start the analysers, which may need to know the port latencies, and then the analysis thread and its helpers. If an analyser fails to start nothing else is started, and no analyser reports a result: they are all released when the analysis is freed.
+// Null test
+
+typedef struct _recap_null {
+ int channels;
+ jack_nframes_t latency[MAX_PORTS];
+ float* delay[MAX_PORTS];
+ float tolerance;
+ double sum_sq[MAX_PORTS];
+ float max_error[MAX_PORTS];
+ sf_count_t max_frame[MAX_PORTS];
+ sf_count_t first_mismatch[MAX_PORTS];
+ sf_count_t mismatches[MAX_PORTS];
+ recap_analysis_t* analysis;
+} recap_null_t;
+
+// Each captured channel is compared with the played channel of the same number, delayed by the round trip latency of the pair. For each, the null test keeps the sum of the squared residual, the largest error and where it was, and the first frame and number of frames that were out by more than the tolerance. delay holds the last latency frames played followed by the current block.
+
+static int null_start(recap_analyser_t* analyser) {
+ recap_null_t* null = (recap_null_t*) analyser->state;
+ int k;
+ for (k = 0; k < null->channels; k++) {
+   null->latency[k] = null_latency >= 0 ? (jack_nframes_t) null_latency : path_latency(k, k);
+   null->delay[k] = (float*) calloc(null->latency[k] + ANALYSIS_BLOCK, sizeof(float));
+   null->first_mismatch[k] = -1;
+   DEBUG("null test: output %i to input %i, latency %u frames\n", k, k, null->latency[k]);
+ }
+ return 0;
+}
+
+// The latency of each pair is taken from jack unless --null-latency gives it.
+
+static float null_residual(const float* captured, const float* played, sf_count_t nframes, float* peak) {
+ sf_count_t i = 0;
+ float sum = 0.0f;
+ float max = 0.0f;
+#if defined(__x86_64__)
+ __m128 sum4 = _mm_setzero_ps();
+ __m128 max4 = _mm_setzero_ps();
+ const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+ for (; i + 4 <= nframes; i += 4) {
+   __m128 e = _mm_sub_ps(_mm_loadu_ps(captured + i), _mm_loadu_ps(played + i));
+   sum4 = _mm_add_ps(sum4, _mm_mul_ps(e, e));
+   max4 = _mm_max_ps(max4, _mm_and_ps(e, abs_mask));
+ }
+ float lanes[4];
+ _mm_storeu_ps(lanes, sum4);
+ sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+ _mm_storeu_ps(lanes, max4);
+ max = fmaxf(fmaxf(lanes[0], lanes[1]), fmaxf(lanes[2], lanes[3]));
+#endif
+ for (; i < nframes; i++) {
+   float e = captured[i] - played[i];
+   sum += e * e;
+   if (fabsf(e) > max) max = fabsf(e);
+ }
+ *peak = max;
+ return sum;
+}
+
+// The residual of a block, four samples at a time with SSE2 where it is available, which is every x86_64 cpu. Only its energy and peak are needed in the common case of a block that nulls.
+
+static void null_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_null_t* null = (recap_null_t*) analyser->state;
+ int k;
+ for (k = 0; k < null->channels; k++) {
+   jack_nframes_t latency = null->latency[k];
+   float* delay = null->delay[k];
+   float peak;
+   memcpy(delay + latency, played[k], nframes * sizeof(float));
+   null->sum_sq[k] += null_residual(captured[k], delay, nframes, &peak);
+   if (peak > null->max_error[k] || (peak > null->tolerance && null->first_mismatch[k] < 0)) {
+     sf_count_t i;
+     for (i = 0; i < nframes; i++) {
+       float e = fabsf(captured[k][i] - delay[i]);
+       if (e > null->max_error[k]) {
+         null->max_error[k] = e;
+         null->max_frame[k] = frame + i;
+       }
+       if (e > null->tolerance && null->first_mismatch[k] < 0)
+         null->first_mismatch[k] = frame + i;
+     }
+   }
+   if (peak > null->tolerance) {
+     sf_count_t i;
+     for (i = 0; i < nframes; i++)
+       null->mismatches[k] += fabsf(captured[k][i] - delay[i]) > null->tolerance;
+   }
+   memmove(delay, delay + nframes, latency * sizeof(float));
+ }
+}
+
+// Blocks are only looked at sample by sample when they hold a new largest error or frames out of tolerance.
+
+static double db(double value) {
+ return value > 0.0 ? 20.0 * log10(value) : -INFINITY;
+}
+
+static void null_release(recap_analyser_t* analyser) {
+ recap_null_t* null = (recap_null_t*) analyser->state;
+ int k;
+ for (k = 0; k < null->channels; k++)
+   free(null->delay[k]);
+ free(null);
+}
+
+static int null_finish(recap_analyser_t* analyser) {
+ recap_null_t* null = (recap_null_t*) analyser->state;
+ sf_count_t frames = null->analysis->frames;
+ int failed = 0;
+ int k;
+ for (k = 0; k < null->channels; k++) {
+   double rms = frames > 0 ? sqrt(null->sum_sq[k] / frames) : 0.0;
+   MSG("null test %i: residual %.1f dBFS, largest error %.1f dBFS at frame %lld\n", k,
+       db(rms), db(null->max_error[k]), (long long) null->max_frame[k]);
+   if (null->first_mismatch[k] >= 0) {
+     MSG("null test %i: %lld frames above %.1f dBFS, the first at frame %lld\n", k,
+         (long long) null->mismatches[k], null_db, (long long) null->first_mismatch[k]);
+     failed = 1;
+   }
+ }
+ MSG("null test %s\n", failed ? "failed" : "passed");
+ null_release(analyser);
+ return failed;
+}
+
+// Report the residual level, the largest error and the first mismatch of each channel, in frames from the start of the capture. The run fails if any frame of any channel is out by more than the threshold.
+
+static int add_null_test(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_null_t* null;
+ int channels = an->played < an->captured ? an->played : an->captured;
+ if (channels == 0) {
+   ERR("null test needs played and captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "null")) == NULL)
+   return EINVAL;
+ null = (recap_null_t*) calloc(1, sizeof(recap_null_t));
+ null->channels = channels;
+ null->analysis = an;
+ null->tolerance = pow(10.0, null_db / 20.0);
+ analyser->start = null_start;
+ analyser->block = null_block;
+ analyser->finish = null_finish;
+ analyser->release = null_release;
+ analyser->state = null;
+ return 0;
+}
+
+// Output n is compared with input n for as many channels as are both played and captured.
+
+static void discard_capture(recap_io_info_t* info) {
+ static const char* sidecars[] = { "", ".times", ".crc32c", ".idx" };
+ long last = info->segment;
+ long segment;
+ size_t k;
+ for (segment = 0; segment <= last; segment++) {
+   if (info->base_path) {
+     info->segment = segment;
+     segment_name(info);
+   }
+   for (k = 0; k < sizeof(sidecars) / sizeof(sidecars[0]); k++) {
+     char path[PATH_MAX];
+     snprintf(path, sizeof(path), "%s%s", info->path, sidecars[k]);
+     unlink(path);
+   }
+ }
+ DEBUG("discarded capture %s\n", info->base_path ? info->base_path : info->path);
+}
+
+// With --null-discard a capture that nulls is of no further interest, so it is deleted along with its sidecars once it has been closed, every file of it when it has been rotated.
+// Transfer function
+
+typedef struct _recap_welch {
+ recap_fft_t* fft;
+ int size;
+ int channels;
+ float* window;
+ jack_nframes_t latency[MAX_PORTS];
+ float* delay[MAX_PORTS];
+ float* stimulus[MAX_PORTS];
+ float* response[MAX_PORTS];
+ int fill;
+ long segments;
+ float* re[MAX_PORTS];
+ float* im[MAX_PORTS];
+ double* sxx[MAX_PORTS];
+ double* syy[MAX_PORTS];
+ double* sxy_re[MAX_PORTS];
+ double* sxy_im[MAX_PORTS];
+ recap_analysis_t* analysis;
+} recap_welch_t;
+
+// The H1 estimate of the transfer function from the first played channel to each captured one. The played signal is delayed by the latency of each path, and segments of size frames, overlapping by half, are Hann windowed and transformed. The auto spectra of stimulus and response and their cross spectrum are summed over every segment. stimulus and response hold the segment being filled, fill frames of it so far.
+
+static int welch_start(recap_analyser_t* analyser) {
+ recap_welch_t* welch = (recap_welch_t*) analyser->state;
+ int k;
+ for (k = 0; k < welch->channels; k++) {
+   welch->latency[k] = path_latency(0, k);
+   welch->delay[k] = (float*) calloc(welch->latency[k] + ANALYSIS_BLOCK, sizeof(float));
+   DEBUG("transfer function: output 0 to input %i, latency %u frames\n", k, welch->latency[k]);
+ }
+ return 0;
+}
+
+static void welch_segment(void* arg, int k) {
+ recap_welch_t* welch = (recap_welch_t*) arg;
+ int n = welch->size;
+ int hop = n / 2;
+ float* re = welch->re[k];
+ float* im = welch->im[k];
+ int i;
+ for (i = 0; i < n; i++) {
+   re[i] = welch->stimulus[k][i] * welch->window[i];
+   im[i] = welch->response[k][i] * welch->window[i];
+ }
+ fft_forward(welch->fft, re, im);
+ for (i = 0; i <= n / 2; i++) {
+   float x[2], y[2];
+   fft_split(n, re, im, i, x, y);
+   welch->sxx[k][i] += x[0] * x[0] + x[1] * x[1];
+   welch->syy[k][i] += y[0] * y[0] + y[1] * y[1];
+   welch->sxy_re[k][i] += x[0] * y[0] + x[1] * y[1];
+   welch->sxy_im[k][i] += x[0] * y[1] - x[1] * y[0];
+ }
+ memmove(welch->stimulus[k], welch->stimulus[k] + hop, hop * sizeof(float));
+ memmove(welch->response[k], welch->response[k] + hop, hop * sizeof(float));
+}
+
+// One transform gives the spectra of both the stimulus and the response of a segment, after which the second half of the segment is kept as the first half of the next. The channels are transformed in parallel.
+
+static void welch_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_welch_t* welch = (recap_welch_t*) analyser->state;
+ int hop = welch->size / 2;
+ sf_count_t done = 0;
+ int k;
+ for (k = 0; k < welch->channels; k++)
+   memcpy(welch->delay[k] + welch->latency[k], played[0], nframes * sizeof(float));
+ while (done < nframes) {
+   sf_count_t count = welch->size - welch->fill;
+   if (count > nframes - done) count = nframes - done;
+   for (k = 0; k < welch->channels; k++) {
+     memcpy(welch->stimulus[k] + welch->fill, welch->delay[k] + done, count * sizeof(float));
+     memcpy(welch->response[k] + welch->fill, captured[k] + done, count * sizeof(float));
+   }
+   welch->fill += count;
+   done += count;
+   if (welch->fill == welch->size) {
+     run_jobs(welch->analysis, welch_segment, welch, welch->channels);
+     welch->fill = hop;
+     welch->segments++;
+   }
+ }
+ for (k = 0; k < welch->channels; k++)
+   memmove(welch->delay[k], welch->delay[k] + nframes, welch->latency[k] * sizeof(float));
+}
+
+static void welch_release(recap_analyser_t* analyser) {
+ recap_welch_t* welch = (recap_welch_t*) analyser->state;
+ int k;
+ for (k = 0; k < welch->channels; k++) {
+   free(welch->delay[k]);
+   free(welch->stimulus[k]);
+   free(welch->response[k]);
+   free(welch->re[k]);
+   free(welch->im[k]);
+   free(welch->sxx[k]);
+   free(welch->syy[k]);
+   free(welch->sxy_re[k]);
+   free(welch->sxy_im[k]);
+ }
+ free(welch->window);
+ fft_free(welch->fft);
+ free(welch);
+}
+
+static int welch_finish(recap_analyser_t* analyser) {
+ recap_welch_t* welch = (recap_welch_t*) analyser->state;
+ FILE* file;
+ int status = 0;
+ int i, k;
+ if (welch->segments == 0) {
+   ERR("transfer function: the capture is shorter than %i frames\n", welch->size);
+   welch_release(analyser);
+   return EINVAL;
+ }
+ if ((file = fopen(welch_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", welch_path, strerror(errno));
+   welch_release(analyser);
+   return errno;
+ }
+ fprintf(file, "frequency");
+ for (k = 0; k < welch->channels; k++)
+   fprintf(file, ",gain_%i,phase_%i,coherence_%i", k, k, k);
+ fprintf(file, "\n");
+ for (i = 0; i <= welch->size / 2; i++) {
+   fprintf(file, "%.3f", (double) i * welch->analysis->rate / welch->size);
+   for (k = 0; k < welch->channels; k++) {
+     double sxx = welch->sxx[k][i];
+     double syy = welch->syy[k][i];
+     double cross = welch->sxy_re[k][i] * welch->sxy_re[k][i] + welch->sxy_im[k][i] * welch->sxy_im[k][i];
+     double gain = sxx > 0.0 ? sqrt(cross) / sxx : 0.0;
+     double phase = atan2(welch->sxy_im[k][i], welch->sxy_re[k][i]) * 180.0 / M_PI;
+     double coherence = sxx > 0.0 && syy > 0.0 ? cross / (sxx * syy) : 0.0;
+     fprintf(file, ",%.3f,%.2f,%.5f", db(gain), phase, coherence);
+   }
+   fprintf(file, "\n");
+ }
+ if (fclose(file)) {
+   ERR("cannot write %s: %s\n", welch_path, strerror(errno));
+   status = errno;
+ }
+ MSG("transfer function: %ld segments of %i frames averaged into %s\n", welch->segments, welch->size, welch_path);
+ welch_release(analyser);
+ return status;
+}
+
+// Write a line per frequency bin to welch_path, with the gain in dB, the phase in degrees and the coherence of each input. H1 is the cross spectrum over the stimulus auto spectrum, and the coherence is the squared cross spectrum over the product of both auto spectra. The phase leaves out the latency jack reports for the path.
+
+static int add_welch(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_welch_t* welch;
+ int size = welch_size;
+ int i, k;
+ if (size < 64 || size > (1 << 20) || (size & (size - 1)) != 0) {
+   ERR("--welch-size must be a power of two from 64 to %i\n", 1 << 20);
+   return EINVAL;
+ }
+ if (an->played == 0 || an->captured == 0) {
+   ERR("transfer function needs played and captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "welch")) == NULL)
+   return EINVAL;
+ welch = (recap_welch_t*) calloc(1, sizeof(recap_welch_t));
+ welch->fft = fft_new(size);
+ welch->size = size;
+ welch->channels = an->captured;
+ welch->analysis = an;
+ welch->window = (float*) calloc(size, sizeof(float));
+ for (i = 0; i < size; i++)
+   welch->window[i] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * i / size));
+ for (k = 0; k < welch->channels; k++) {
+   welch->stimulus[k] = (float*) calloc(size, sizeof(float));
+   welch->response[k] = (float*) calloc(size, sizeof(float));
+   welch->re[k] = (float*) calloc(size, sizeof(float));
+   welch->im[k] = (float*) calloc(size, sizeof(float));
+   welch->sxx[k] = (double*) calloc(size / 2 + 1, sizeof(double));
+   welch->syy[k] = (double*) calloc(size / 2 + 1, sizeof(double));
+   welch->sxy_re[k] = (double*) calloc(size / 2 + 1, sizeof(double));
+   welch->sxy_im[k] = (double*) calloc(size / 2 + 1, sizeof(double));
+ }
+ analyser->start = welch_start;
+ analyser->block = welch_block;
+ analyser->finish = welch_finish;
+ analyser->release = welch_release;
+ analyser->state = welch;
+ return 0;
+}
+
+// Every captured channel is measured against the first played one.
+// Multiple exponential sweeps
+
+#define THD_MAX_SIZE 8192
+#define THD_COLUMNS (MESM_ORDER + 1)
+
+typedef struct _recap_mesm {
+ recap_io_info_t* source;
+ int inputs;
+ jack_nframes_t latency[MAX_PORTS][MAX_PORTS];
+ float* capture[MAX_PORTS];
+ sf_count_t frames;
+ sf_count_t size;
+ sf_count_t ir_frames;
+ recap_fft_t* fft;
+ sf_count_t n;
+ float* sweep_re;
+ float* sweep_im;
+ double floor;
+ float* responses;
+ recap_fft_t* thd_fft;
+ int thd_size;
+ float* thd[MAX_PORTS];
+} recap_mesm_t;
+
+// The impulse response from each channel of the sweep source to each input is recovered from a single capture. The captured channels are kept in memory, size frames of room for frames of them, and deconvolved at the end with transforms of n points, by the spectrum of the sweep in sweep_re and sweep_im. latency holds the round trip latency of every path from a sweep channel to an input. The impulse responses are collected in responses for --mesm, and the distortion of each input for --thd in thd, a row of THD_COLUMNS for each bin of a transform of thd_size points.
+
+static int mesm_start(recap_analyser_t* analyser) {
+ recap_mesm_t* mesm = (recap_mesm_t*) analyser->state;
+ int c, k;
+ for (c = 0; c < mesm->source->channels; c++) {
+   for (k = 0; k < mesm->inputs; k++)
+     mesm->latency[c][k] = path_latency(mesm->source->port_offset + c, k);
+ }
+ return 0;
+}
+
+static void mesm_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_mesm_t* mesm = (recap_mesm_t*) analyser->state;
+ int k;
+ if (mesm->frames + nframes > mesm->size) {
+   mesm->size = 2 * (mesm->frames + nframes);
+   for (k = 0; k < mesm->inputs; k++)
+     mesm->capture[k] = (float*) realloc(mesm->capture[k], mesm->size * sizeof(float));
+ }
+ for (k = 0; k < mesm->inputs; k++)
+   memcpy(mesm->capture[k] + mesm->frames, captured[k], nframes * sizeof(float));
+ mesm->frames += nframes;
+}
+
+// The capture is set aside as it arrives; the analysis thread allocates as it needs to, never the jack thread.
+
+static int write_responses(const char* path, int rate, int channels, float* data, sf_count_t frames) {
+ SF_INFO sf_info;
+ SNDFILE* file;
+ memset(&sf_info, 0, sizeof(sf_info));
+ sf_info.samplerate = rate;
+ sf_info.channels = channels;
+ sf_info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+ if ((file = sf_open(path, SFM_WRITE, &sf_info)) == NULL) {
+   ERR("cannot write sndfile: %s\n", path);
+   return EIO;
+ }
+ if (sf_writef_float(file, data, frames) < frames) {
+   ERR("cannot write sndfile (%s)\n", sf_strerror(file));
+   sf_close(file);
+   return EIO;
+ }
+ sf_close(file);
+ return 0;
+}
+
+// Impulse responses are written as float wave files, one channel per input.
+
+static float* deconvolve(recap_mesm_t* mesm, const float* capture) {
+ sf_count_t n = mesm->n;
+ float* re = (float*) calloc(n, sizeof(float));
+ float* im = (float*) calloc(n, sizeof(float));
+ sf_count_t i;
+ memcpy(re, capture, mesm->frames * sizeof(float));
+ fft_forward(mesm->fft, re, im);
+ for (i = 0; i < n; i++) {
+   double power = (double) mesm->sweep_re[i] * mesm->sweep_re[i] + (double) mesm->sweep_im[i] * mesm->sweep_im[i] + mesm->floor;
+   double r = (re[i] * mesm->sweep_re[i] + im[i] * mesm->sweep_im[i]) / power;
+   double j = (im[i] * mesm->sweep_re[i] - re[i] * mesm->sweep_im[i]) / power;
+   re[i] = (float) r;
+   im[i] = (float) j;
+ }
+ fft_inverse(mesm->fft, re, im);
+ free(im);
+ return re;
+}
+
+// Deconvolve a captured channel by dividing its spectrum by that of the sweep, regularized MESM_REGULARIZE below the sweep's peak power so bins outside the sweep's range are not blown up. Returns n frames of response, in which a response that comes before the sweep wraps round to the end.
+
+static void thd_measure(recap_mesm_t* mesm, int k, const float* response) {
+ recap_sweep_t* sweep = mesm->source->sweep;
+ int size = mesm->thd_size;
+ int taper = size / 8;
+ sf_count_t linear = k * sweep->stagger + mesm->latency[k][k];
+ float* re = (float*) malloc(size * sizeof(float));
+ float* im = (float*) malloc(size * sizeof(float));
+ double* magnitude = (double*) calloc((MESM_ORDER + 1) * (size / 2 + 1), sizeof(double));
+ float* row = mesm->thd[k];
+ int order, b, i;
+ for (order = 0; order <= MESM_ORDER; order++) {
+   double* m = magnitude + order * (size / 2 + 1);
+   sf_count_t start;
+   if (order == 0)
+     start = linear + mesm->ir_frames - size;
+   else
+     start = linear - lround(sweep->length * log(order) / log(sweep->high / sweep->low)) - taper;
+   for (i = 0; i < size; i++) {
+     float w = 1.0f;
+     if (i < taper) w = 0.5f - 0.5f * cosf(M_PI * i / taper);
+     else if (i >= size - taper) w = 0.5f - 0.5f * cosf(M_PI * (size - 1 - i) / taper);
+     re[i] = w * response[((start + i) % mesm->n + mesm->n) % mesm->n];
+     im[i] = 0.0f;
+   }
+   fft_forward(mesm->thd_fft, re, im);
+   for (b = 0; b <= size / 2; b++)
+     m[b] = hypot(re[b], im[b]);
+ }
+ for (b = 0; b <= size / 2; b++) {
+   double fundamental = magnitude[(size / 2 + 1) + b];
+   double harmonics = 0.0;
+   double noise = magnitude[b];
+   for (order = 2; order <= MESM_ORDER; order++) {
+     double h = order * b <= size / 2 ? magnitude[order * (size / 2 + 1) + order * b] : 0.0;
+     harmonics += h * h;
+     row[b * THD_COLUMNS + order] = fundamental > 0.0 && h > 0.0 ? db(h / fundamental) : NAN;
+   }
+   row[b * THD_COLUMNS] = fundamental > 0.0 ? 100.0 * sqrt(harmonics) / fundamental : NAN;
+   row[b * THD_COLUMNS + 1] = fundamental > 0.0 ? 100.0 * sqrt(harmonics + noise * noise) / fundamental : NAN;
+ }
+ free(re);
+ free(im);
+ free(magnitude);
+}
+
+// The harmonic responses of an exponential sweep come before its linear response, harmonic h by length ln h / ln(high / low) frames, and are cut out with windows of thd_size frames, tapered over their first and last eighths and started an eighth early to catch the start of each response. The spectrum of harmonic h at h times a frequency is its level when that frequency is played. The noise is taken from the last thd_size frames of the impulse response window, by which time the response should have died away. A row per bin holds THD and THD+N in percent and the level of each harmonic relative to the fundamental in dB.
+
+static void mesm_job(void* arg, int k) {
+ recap_mesm_t* mesm = (recap_mesm_t*) arg;
+ recap_sweep_t* sweep = mesm->source->sweep;
+ float* response = deconvolve(mesm, mesm->capture[k]);
+ sf_count_t i;
+ int c;
+ if (mesm_path) {
+   for (c = 0; c < mesm->source->channels; c++) {
+     sf_count_t start = c * sweep->stagger + mesm->latency[c][k];
+     float* out = mesm->responses + c * mesm->inputs * mesm->ir_frames + k;
+     for (i = 0; i < mesm->ir_frames && start + i < mesm->n; i++)
+       out[i * mesm->inputs] = response[start + i];
+   }
+ }
+ if (thd_path && k < mesm->source->channels)
+   thd_measure(mesm, k, response);
+ free(response);
+}
+
+// Each input is deconvolved on its own, so the inputs are shared out among the analysis threads. The response of sweep channel c comes c stagger frames plus the latency of the path into the result, and is cut out --mesm-ir seconds long. Distortion is measured from output n to input n.
+
+static int write_thd(recap_mesm_t* mesm) {
+ recap_sweep_t* sweep = mesm->source->sweep;
+ int pairs = mesm->inputs < mesm->source->channels ? mesm->inputs : mesm->source->channels;
+ FILE* file;
+ int b, k, order;
+ if ((file = fopen(thd_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", thd_path, strerror(errno));
+   return errno;
+ }
+ fprintf(file, "frequency");
+ for (k = 0; k < pairs; k++) {
+   fprintf(file, ",thd_%i,thdn_%i", k, k);
+   for (order = 2; order <= MESM_ORDER; order++)
+     fprintf(file, ",h%i_%i", order, k);
+ }
+ fprintf(file, "\n");
+ for (b = 1; b <= mesm->thd_size / 2; b++) {
+   double frequency = (double) b * sweep->rate / mesm->thd_size;
+   if (frequency < sweep->low || 2.0 * frequency > sweep->high) continue;
+   fprintf(file, "%.2f", frequency);
+   for (k = 0; k < pairs; k++) {
+     float* row = mesm->thd[k] + b * THD_COLUMNS;
+     fprintf(file, ",%.4f,%.4f", row[0], row[1]);
+     for (order = 2; order <= MESM_ORDER; order++)
+       fprintf(file, ",%.2f", row[order]);
+   }
+   fprintf(file, "\n");
+ }
+ if (fclose(file)) {
+   ERR("cannot write %s: %s\n", thd_path, strerror(errno));
+   return errno;
+ }
+ MSG("harmonic distortion of %i outputs written to %s\n", pairs, thd_path);
+ return 0;
+}
+
+// A line per frequency from the bottom of the sweep to half its top, where the second harmonic is still in the sweep's range.
+
+static void mesm_release(recap_analyser_t* analyser) {
+ recap_mesm_t* mesm = (recap_mesm_t*) analyser->state;
+ int k;
+ for (k = 0; k < mesm->inputs; k++) {
+   free(mesm->capture[k]);
+   free(mesm->thd[k]);
+ }
+ free(mesm->sweep_re);
+ free(mesm->sweep_im);
+ free(mesm->responses);
+ fft_free(mesm->fft);
+ fft_free(mesm->thd_fft);
+ free(mesm);
+}
+
+static int mesm_finish(recap_analyser_t* analyser) {
+ recap_mesm_t* mesm = (recap_mesm_t*) analyser->state;
+ recap_sweep_t* sweep = mesm->source->sweep;
+ int outputs = mesm->source->channels;
+ int status = 0;
+ double spacing = sweep->length * log((double) MESM_ORDER / (MESM_ORDER - 1)) / log(sweep->high / sweep->low);
+ sf_count_t i;
+ int c, k;
+ mesm->n = 1;
+ while (mesm->n < mesm->frames + sweep->length) mesm->n *= 2;
+ mesm->fft = fft_new(mesm->n);
+ mesm->sweep_re = (float*) calloc(mesm->n, sizeof(float));
+ mesm->sweep_im = (float*) calloc(mesm->n, sizeof(float));
+ render_sweep(sweep, mesm->sweep_re, 1);
+ fft_forward(mesm->fft, mesm->sweep_re, mesm->sweep_im);
+ mesm->floor = 0.0;
+ for (i = 0; i < mesm->n; i++) {
+   double power = (double) mesm->sweep_re[i] * mesm->sweep_re[i] + (double) mesm->sweep_im[i] * mesm->sweep_im[i];
+   if (power > mesm->floor) mesm->floor = power;
+ }
+ mesm->floor *= MESM_REGULARIZE;
+ if (mesm_path)
+   mesm->responses = (float*) calloc(outputs * mesm->inputs * mesm->ir_frames, sizeof(float));
+ if (thd_path) {
+   mesm->thd_size = 1;
+   while (2 * mesm->thd_size <= spacing && 2 * mesm->thd_size <= mesm->ir_frames && mesm->thd_size < THD_MAX_SIZE)
+     mesm->thd_size *= 2;
+   if (mesm->thd_size < 64) {
+     ERR("the sweep is too short to tell its harmonics apart\n");
+     status = EINVAL;
+   } else {
+     mesm->thd_fft = fft_new(mesm->thd_size);
+     for (k = 0; k < mesm->inputs && k < outputs; k++)
+       mesm->thd[k] = (float*) calloc((mesm->thd_size / 2 + 1) * THD_COLUMNS, sizeof(float));
+   }
+ }
+ if (!status)
+   run_jobs(proc_info->analysis, mesm_job, mesm, mesm->inputs);
+ for (c = 0; c < outputs && mesm_path && !status; c++) {
+   char path[PATH_MAX];
+   snprintf(path, sizeof(path), "%s-%02i.wav", mesm_path, mesm->source->port_offset + c);
+   status = write_responses(path, sweep->rate, mesm->inputs,
+                            mesm->responses + c * mesm->inputs * mesm->ir_frames, mesm->ir_frames);
+ }
+ if (mesm_path && !status)
+   MSG("impulse responses of %i outputs to %i inputs written to %s-NN.wav\n", outputs, mesm->inputs, mesm_path);
+ if (thd_path && !status)
+   status = write_thd(mesm);
+ mesm_release(analyser);
+ return status;
+}
+
+// The responses of output port NN are written to mesm_path-NN.wav. The distortion windows are the largest power of two, up to THD_MAX_SIZE, that fits between the last two harmonics measured and within the impulse response.
+
+static int add_mesm(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_mesm_t* mesm;
+ recap_io_info_t* source = NULL;
+ int i;
+ for (i = 0; i < proc_info->reader_count && source == NULL; i++) {
+   if (proc_info->readers[i].sweep && !proc_info->readers[i].sweep->noise) source = &proc_info->readers[i];
+ }
+ if (source == NULL || loop_count != 1) {
+   ERR("--mesm and --thd need a sweep:low:high:secs source played once\n");
+   return EINVAL;
+ }
+ if (an->captured == 0) {
+   ERR("--mesm and --thd need captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "mesm")) == NULL)
+   return EINVAL;
+ mesm = (recap_mesm_t*) calloc(1, sizeof(recap_mesm_t));
+ mesm->source = source;
+ mesm->inputs = an->captured;
+ mesm->ir_frames = (sf_count_t) (mesm_ir_secs * source->sweep->rate);
+ mesm->size = source->loop_length + source->sweep->tail;
+ for (i = 0; i < mesm->inputs; i++)
+   mesm->capture[i] = (float*) malloc(mesm->size * sizeof(float));
+ analyser->start = mesm_start;
+ analyser->block = mesm_block;
+ analyser->finish = mesm_finish;
+ analyser->release = mesm_release;
+ analyser->state = mesm;
+ return 0;
+}
+
+// The first sweep source is measured. Room for the whole capture is set aside up front.
+// Crosstalk
+
+#define CROSSTALK_FFT 4096
+#define CROSSTALK_BANDS 10
+
+typedef struct _recap_crosstalk_channel {
+ float* data;
+ float* segment;
+ float* re;
+ float* im;
+ int fill;
+ sf_count_t skip;
+ sf_count_t start;
+ double power[MAX_PORTS][CROSSTALK_BANDS];
+ long segments[MAX_PORTS];
+} recap_crosstalk_channel_t;
+
+typedef struct _recap_crosstalk {
+ recap_io_info_t* source;
+ recap_analysis_t* analysis;
+ recap_fft_t* fft;
+ float* window;
+ int outputs;
+ int inputs;
+ int band_low[CROSSTALK_BANDS];
+ int band_high[CROSSTALK_BANDS];
+ jack_nframes_t latency[MAX_PORTS][MAX_PORTS];
+ recap_crosstalk_channel_t channel[2 * MAX_PORTS];
+ sf_count_t frame;
+ sf_count_t nframes;
+} recap_crosstalk_t;
+
+// The coupling from every channel of a noise source to every input, in octave bands. Each output plays noise on its own in turn, so whatever reaches each input during output c's stretch came from output c. The noise source's own channels come first in channel, then the inputs. Each collects segments of CROSSTALK_FFT frames, overlapping by half, the segment being filled starting at frame start, and sums the power of each band over the segments that lie wholly within an output's stretch, as it arrives at that channel. frame and nframes describe the block being analysed.
+
+static double band_centre(int b) {
+ return 1000.0 * pow(2.0, b - 5);
+}
+
+static int crosstalk_start(recap_analyser_t* analyser) {
+ recap_crosstalk_t* xt = (recap_crosstalk_t*) analyser->state;
+ int n = CROSSTALK_FFT;
+ int b, c, k;
+ for (b = 0; b < CROSSTALK_BANDS; b++) {
+   xt->band_low[b] = (int) lround(band_centre(b) / M_SQRT2 * n / xt->analysis->rate);
+   xt->band_high[b] = (int) lround(band_centre(b) * M_SQRT2 * n / xt->analysis->rate);
+   if (xt->band_low[b] < 1) xt->band_low[b] = 1;
+   if (xt->band_high[b] > n / 2) xt->band_high[b] = n / 2;
+ }
+ for (c = 0; c < xt->outputs; c++) {
+   for (k = 0; k < xt->inputs; k++)
+     xt->latency[c][k] = path_latency(xt->source->port_offset + c, k);
+ }
+ for (k = 0; k < xt->inputs; k++) {
+   xt->channel[xt->outputs + k].skip = xt->latency[0][k];
+   xt->channel[xt->outputs + k].start = xt->latency[0][k];
+ }
+ return 0;
+}
+
+// Octave bands from 31.25 Hz to 16 kHz, centred on powers of two times 1 kHz. Each input skips the latency of its path from the first output, so that its segments hold the same stretches of noise as those of the outputs, and the ratio of their levels is not thrown by the noise varying.
+
+static int crosstalk_slot(recap_crosstalk_t* xt, int j, sf_count_t start) {
+ recap_sweep_t* noise = xt->source->sweep;
+ int c;
+ for (c = 0; c < xt->outputs; c++) {
+   sf_count_t from = c * noise->stagger + (j < xt->outputs ? 0 : xt->latency[c][j - xt->outputs]);
+   if (start >= from && start + CROSSTALK_FFT <= from + noise->length) return c;
+ }
+ return -1;
+}
+
+// The output whose noise fills the whole segment starting at frame start of channel j, or -1.
+
+static void crosstalk_job(void* arg, int j) {
+ recap_crosstalk_t* xt = (recap_crosstalk_t*) arg;
+ recap_crosstalk_channel_t* channel = &xt->channel[j];
+ int n = CROSSTALK_FFT;
+ int hop = n / 2;
+ sf_count_t done = channel->skip < xt->nframes ? channel->skip : xt->nframes;
+ channel->skip -= done;
+ while (done < xt->nframes) {
+   sf_count_t count = n - channel->fill;
+   int c, b, i;
+   if (count > xt->nframes - done) count = xt->nframes - done;
+   memcpy(channel->segment + channel->fill, channel->data + done, count * sizeof(float));
+   channel->fill += count;
+   done += count;
+   if (channel->fill < n) break;
+   if ((c = crosstalk_slot(xt, j, channel->start)) >= 0) {
+     for (i = 0; i < n; i++) {
+       channel->re[i] = channel->segment[i] * xt->window[i];
+       channel->im[i] = 0.0f;
+     }
+     fft_forward(xt->fft, channel->re, channel->im);
+     for (b = 0; b < CROSSTALK_BANDS; b++) {
+       double power = 0.0;
+       for (i = xt->band_low[b]; i < xt->band_high[b]; i++)
+         power += channel->re[i] * channel->re[i] + channel->im[i] * channel->im[i];
+       channel->power[c][b] += power;
+     }
+     channel->segments[c]++;
+   }
+   memmove(channel->segment, channel->segment + hop, hop * sizeof(float));
+   channel->fill = hop;
+   channel->start += hop;
+ }
+}
+
+static void crosstalk_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_crosstalk_t* xt = (recap_crosstalk_t*) analyser->state;
+ int j;
+ for (j = 0; j < xt->outputs; j++)
+   xt->channel[j].data = played[xt->source->port_offset + j];
+ for (j = 0; j < xt->inputs; j++)
+   xt->channel[xt->outputs + j].data = captured[j];
+ xt->frame = frame;
+ xt->nframes = nframes;
+ run_jobs(xt->analysis, crosstalk_job, xt, xt->outputs + xt->inputs);
+}
+
+// Every channel is windowed, transformed and summed into bands on its own, so the channels are shared out among the analysis threads.
+
+static void crosstalk_release(recap_analyser_t* analyser) {
+ recap_crosstalk_t* xt = (recap_crosstalk_t*) analyser->state;
+ int j;
+ for (j = 0; j < xt->outputs + xt->inputs; j++) {
+   free(xt->channel[j].segment);
+   free(xt->channel[j].re);
+   free(xt->channel[j].im);
+ }
+ free(xt->window);
+ fft_free(xt->fft);
+ free(xt);
+}
+
+static int crosstalk_finish(recap_analyser_t* analyser) {
+ recap_crosstalk_t* xt = (recap_crosstalk_t*) analyser->state;
+ FILE* file;
+ int status = 0;
+ int b, c, j;
+ if ((file = fopen(crosstalk_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", crosstalk_path, strerror(errno));
+   status = errno;
+ } else {
+   fprintf(file, "band,output");
+   for (j = 0; j < xt->inputs; j++)
+     fprintf(file, ",input_%i", j);
+   fprintf(file, "\n");
+   for (b = 0; b < CROSSTALK_BANDS; b++) {
+     for (c = 0; c < xt->outputs; c++) {
+       recap_crosstalk_channel_t* out = &xt->channel[c];
+       fprintf(file, "%.2f,%i", band_centre(b), xt->source->port_offset + c);
+       for (j = 0; j < xt->inputs; j++) {
+         recap_crosstalk_channel_t* in = &xt->channel[xt->outputs + j];
+         if (out->segments[c] == 0 || in->segments[c] == 0 || out->power[c][b] <= 0.0)
+           fprintf(file, ",nan");
+         else
+           fprintf(file, ",%.2f", 10.0 * log10((in->power[c][b] / in->segments[c]) /
+                                             (out->power[c][b] / out->segments[c]) + 1e-30));
+       }
+       fprintf(file, "\n");
+     }
+   }
+   if (fclose(file)) {
+     ERR("cannot write %s: %s\n", crosstalk_path, strerror(errno));
+     status = errno;
+   } else {
+     MSG("crosstalk of %i outputs to %i inputs written to %s\n", xt->outputs, xt->inputs, crosstalk_path);
+   }
+ }
+ crosstalk_release(analyser);
+ return status;
+}
+
+// The matrix is written with a line per band and output and a column per input, each the level at that input relative to the level played, in dB. A pair with no whole segment in range, because the noise is shorter than CROSSTALK_FFT frames or the latency is longer than NOISE_GAP, is left as nan.
+
+static int add_crosstalk(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_crosstalk_t* xt;
+ recap_io_info_t* source = NULL;
+ int i, j;
+ for (i = 0; i < proc_info->reader_count && source == NULL; i++) {
+   if (proc_info->readers[i].sweep && proc_info->readers[i].sweep->noise) source = &proc_info->readers[i];
+ }
+ if (source == NULL || loop_count != 1) {
+   ERR("--crosstalk needs a noise:secs source played once\n");
+   return EINVAL;
+ }
+ if (an->captured == 0) {
+   ERR("--crosstalk needs captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "crosstalk")) == NULL)
+   return EINVAL;
+ xt = (recap_crosstalk_t*) calloc(1, sizeof(recap_crosstalk_t));
+ xt->source = source;
+ xt->analysis = an;
+ xt->outputs = source->channels;
+ xt->inputs = an->captured;
+ xt->fft = fft_new(CROSSTALK_FFT);
+ xt->window = (float*) calloc(CROSSTALK_FFT, sizeof(float));
+ for (i = 0; i < CROSSTALK_FFT; i++)
+   xt->window[i] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * i / CROSSTALK_FFT));
+ for (j = 0; j < xt->outputs + xt->inputs; j++) {
+   xt->channel[j].segment = (float*) calloc(CROSSTALK_FFT, sizeof(float));
+   xt->channel[j].re = (float*) calloc(CROSSTALK_FFT, sizeof(float));
+   xt->channel[j].im = (float*) calloc(CROSSTALK_FFT, sizeof(float));
+ }
+ analyser->start = crosstalk_start;
+ analyser->block = crosstalk_block;
+ analyser->finish = crosstalk_finish;
+ analyser->release = crosstalk_release;
+ analyser->state = xt;
+ return 0;
+}
+
+// The first noise source is measured against every input.
+// Stepped sine
+
+#define STEP_CHUNK 2048
+#define STEP_MIN_CHUNKS 3
+#define STEP_TOLERANCE 1e-4
+#define STEP_SETTLE_MS 20
+#define STEP_MAX_SECS 2
+
+typedef struct _recap_stepped {
+ recap_io_info_t* source;
+ recap_tone_t* tone;
+ int inputs;
+ jack_nframes_t latency[MAX_PORTS];
+ jack_nframes_t max_latency;
+ int step;
+ int waiting;
+ sf_count_t from;
+ sf_count_t next;
+ sf_count_t chunk;
+ sf_count_t chunk_left;
+ int chunks;
+ double omega;
+ double sum_i[MAX_PORTS + 1];
+ double sum_q[MAX_PORTS + 1];
+ double last_re[MAX_PORTS];
+ double last_im[MAX_PORTS];
+ float* ref_cos;
+ float* ref_sin;
+ double gain[MAX_STEPS][MAX_PORTS];
+ double phase[MAX_STEPS][MAX_PORTS];
+ sf_count_t frames[MAX_STEPS];
+ int settled[MAX_STEPS];
+} recap_stepped_t;
+
+// The lock-in measurement of a steps source. For each step, once the tone has had STEP_SETTLE_MS, or four periods, to get round every path, the first played channel of the source and every input are multiplied by a cosine and a sine at the tone's frequency, from frame from, and summed into sum_i and sum_q, the played channel last. The sums are looked at every chunk frames, a whole number of periods near STEP_CHUNK, and the step is over when the response of every input has changed by less than STEP_TOLERANCE over the last chunk, or after STEP_MAX_SECS. waiting is set while the tone of step has not started yet.
+
+static void lockin_sums(const float* x, const float* ref_cos, const float* ref_sin, sf_count_t n, double* sum_i, double* sum_q) {
+ sf_count_t i = 0;
+ float in_phase = 0.0f;
+ float quadrature = 0.0f;
+#if defined(__x86_64__)
+ __m128 i4 = _mm_setzero_ps();
+ __m128 q4 = _mm_setzero_ps();
+ for (; i + 4 <= n; i += 4) {
+   __m128 v = _mm_loadu_ps(x + i);
+   i4 = _mm_add_ps(i4, _mm_mul_ps(v, _mm_loadu_ps(ref_cos + i)));
+   q4 = _mm_add_ps(q4, _mm_mul_ps(v, _mm_loadu_ps(ref_sin + i)));
+ }
+ float lanes[4];
+ _mm_storeu_ps(lanes, i4);
+ in_phase = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+ _mm_storeu_ps(lanes, q4);
+ quadrature = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+ for (; i < n; i++) {
+   in_phase += x[i] * ref_cos[i];
+   quadrature += x[i] * ref_sin[i];
+ }
+ *sum_i += in_phase;
+ *sum_q += quadrature;
+}
+
+// The two products of a channel with the reference, four samples at a time with SSE2. Each call covers at most one block, so float partial sums lose nothing that matters before they are added into double.
+
+static void stepped_begin(recap_stepped_t* stepped) {
+ recap_tone_t* tone = stepped->tone;
+ double frequency = tone_frequency(tone, stepped->step);
+ sf_count_t settle = (sf_count_t) STEP_SETTLE_MS * tone->rate / 1000;
+ sf_count_t periods = (sf_count_t) ceil(STEP_CHUNK * frequency / tone->rate);
+ if (settle < 4 * tone->rate / frequency) settle = (sf_count_t) (4 * tone->rate / frequency);
+ stepped->omega = 2.0 * M_PI * frequency / tone->rate;
+ stepped->from = tone->start[stepped->step] + stepped->max_latency + settle;
+ stepped->next = stepped->from;
+ stepped->chunk = (sf_count_t) lround(periods * tone->rate / frequency);
+ stepped->chunk_left = stepped->chunk;
+ stepped->chunks = 0;
+ memset(stepped->sum_i, 0, sizeof(stepped->sum_i));
+ memset(stepped->sum_q, 0, sizeof(stepped->sum_q));
+ stepped->waiting = 0;
+}
+
+static int stepped_chunk(recap_stepped_t* stepped) {
+ int played = stepped->inputs;
+ double ref_re = stepped->sum_i[played];
+ double ref_im = -stepped->sum_q[played];
+ double ref_power = ref_re * ref_re + ref_im * ref_im;
+ int settled = ++stepped->chunks >= STEP_MIN_CHUNKS;
+ int k;
+ for (k = 0; k < stepped->inputs; k++) {
+   double re = stepped->sum_i[k];
+   double im = -stepped->sum_q[k];
+   double h_re = ref_power > 0.0 ? (re * ref_re + im * ref_im) / ref_power : 0.0;
+   double h_im = ref_power > 0.0 ? (im * ref_re - re * ref_im) / ref_power : 0.0;
+   double change = hypot(h_re - stepped->last_re[k], h_im - stepped->last_im[k]);
+   if (change > STEP_TOLERANCE * hypot(h_re, h_im)) settled = 0;
+   stepped->last_re[k] = h_re;
+   stepped->last_im[k] = h_im;
+ }
+ return settled;
+}
+
+// Look at the response of each input, the ratio of its complex amplitude to that of the played channel, at the end of a chunk.
+
+static void stepped_done(recap_stepped_t* stepped, int settled) {
+ int s = stepped->step;
+ int k;
+ for (k = 0; k < stepped->inputs; k++) {
+   double phase = atan2(stepped->last_im[k], stepped->last_re[k]) + stepped->omega * stepped->latency[k];
+   stepped->gain[s][k] = db(hypot(stepped->last_re[k], stepped->last_im[k]));
+   stepped->phase[s][k] = remainder(phase, 2.0 * M_PI) * 180.0 / M_PI;
+ }
+ stepped->frames[s] = stepped->next - stepped->from;
+ stepped->settled[s] = settled;
+ DEBUG("step %i at %.1f Hz %s after %lld frames\n", s, tone_frequency(stepped->tone, s),
+       settled ? "settled" : "timed out", (long long) stepped->frames[s]);
+ stepped->step++;
+ stepped->waiting = 1;
+ atomic_store_explicit(&stepped->tone->wanted, stepped->step, memory_order_release);
+}
+
+// Keep the result of a step and ask the jack thread for the next one. The phase leaves out the latency jack reports for each path.
+
+static void stepped_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_stepped_t* stepped = (recap_stepped_t*) analyser->state;
+ recap_tone_t* tone = stepped->tone;
+ sf_count_t end = frame + nframes;
+ while (stepped->step < tone->steps) {
+   sf_count_t run, i;
+   int k;
+   if (stepped->waiting) {
+     if (atomic_load_explicit(&tone->started, memory_order_acquire) <= stepped->step) return;
+     stepped_begin(stepped);
+   }
+   if (stepped->next >= end) return;
+   if (stepped->next < frame) {
+     stepped->next = frame;
+     stepped->from = frame;
+   }
+   run = end - stepped->next;
+   if (run > stepped->chunk_left) run = stepped->chunk_left;
+   for (i = 0; i < run; i++) {
+     double angle = stepped->omega * (stepped->next + i - stepped->from);
+     stepped->ref_cos[i] = (float) cos(angle);
+     stepped->ref_sin[i] = (float) sin(angle);
+   }
+   for (k = 0; k < stepped->inputs; k++)
+     lockin_sums(captured[k] + (stepped->next - frame), stepped->ref_cos, stepped->ref_sin, run,
+                 &stepped->sum_i[k], &stepped->sum_q[k]);
+   lockin_sums(played[stepped->source->port_offset] + (stepped->next - frame), stepped->ref_cos, stepped->ref_sin,
+               run, &stepped->sum_i[stepped->inputs], &stepped->sum_q[stepped->inputs]);
+   stepped->next += run;
+   stepped->chunk_left -= run;
+   if (stepped->chunk_left == 0) {
+     int settled = stepped_chunk(stepped);
+     stepped->chunk_left = stepped->chunk;
+     if (settled || stepped->next - stepped->from >= (sf_count_t) STEP_MAX_SECS * tone->rate)
+       stepped_done(stepped, settled);
+   }
+ }
+}
+
+// Demodulate as much of the block as belongs to the current step. The reference is worked out afresh from the frame number for each block, so it does not wander however long a step runs.
+
+static int stepped_start(recap_analyser_t* analyser) {
+ recap_stepped_t* stepped = (recap_stepped_t*) analyser->state;
+ int k;
+ for (k = 0; k < stepped->inputs; k++) {
+   stepped->latency[k] = path_latency(stepped->source->port_offset, k);
+   if (stepped->latency[k] > stepped->max_latency) stepped->max_latency = stepped->latency[k];
+ }
+ return 0;
+}
+
+static void stepped_release(recap_analyser_t* analyser) {
+ recap_stepped_t* stepped = (recap_stepped_t*) analyser->state;
+ free(stepped->ref_cos);
+ free(stepped->ref_sin);
+ free(stepped);
+}
+
+static int stepped_finish(recap_analyser_t* analyser) {
+ recap_stepped_t* stepped = (recap_stepped_t*) analyser->state;
+ FILE* file;
+ int status = 0;
+ int s, k;
+ if ((file = fopen(stepped_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", stepped_path, strerror(errno));
+   status = errno;
+ } else {
+   fprintf(file, "frequency");
+   for (k = 0; k < stepped->inputs; k++)
+     fprintf(file, ",gain_%i,phase_%i", k, k);
+   fprintf(file, ",frames,settled\n");
+   for (s = 0; s < stepped->step; s++) {
+     fprintf(file, "%.3f", tone_frequency(stepped->tone, s));
+     for (k = 0; k < stepped->inputs; k++)
+       fprintf(file, ",%.3f,%.2f", stepped->gain[s][k], stepped->phase[s][k]);
+     fprintf(file, ",%lld,%i\n", (long long) stepped->frames[s], stepped->settled[s]);
+   }
+   if (fclose(file)) {
+     ERR("cannot write %s: %s\n", stepped_path, strerror(errno));
+     status = errno;
+   } else {
+     MSG("stepped sine: %i of %i steps written to %s\n", stepped->step, stepped->tone->steps, stepped_path);
+   }
+ }
+ if (stepped->step < stepped->tone->steps) status = status ? status : EPIPE;
+ stepped_release(analyser);
+ return status;
+}
+
+// Write a line per step with the gain in dB and phase in degrees of each input, the number of frames the step was measured over, and whether it settled or timed out. A run that stopped before the last step fails.
+
+static int add_stepped(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_stepped_t* stepped;
+ recap_io_info_t* source = NULL;
+ int i;
+ for (i = 0; i < proc_info->reader_count && source == NULL; i++) {
+   if (proc_info->readers[i].tone) source = &proc_info->readers[i];
+ }
+ if (source == NULL) {
+   ERR("--stepped needs a steps:low:high:count source\n");
+   return EINVAL;
+ }
+ if (an->captured == 0) {
+   ERR("--stepped needs captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "stepped")) == NULL)
+   return EINVAL;
+ stepped = (recap_stepped_t*) calloc(1, sizeof(recap_stepped_t));
+ stepped->source = source;
+ stepped->tone = source->tone;
+ stepped->inputs = an->captured;
+ stepped->waiting = 1;
+ stepped->ref_cos = (float*) calloc(ANALYSIS_BLOCK, sizeof(float));
+ stepped->ref_sin = (float*) calloc(ANALYSIS_BLOCK, sizeof(float));
+ analyser->start = stepped_start;
+ analyser->block = stepped_block;
+ analyser->finish = stepped_finish;
+ analyser->release = stepped_release;
+ analyser->state = stepped;
+ return 0;
+}
+
+// The first steps source is measured, and only one can be.
+// Averaging
+
+typedef struct _recap_average {
+ recap_io_info_t* source;
+ int inputs;
+ jack_nframes_t latency[MAX_PORTS];
+ sf_count_t period;
+ sf_count_t next[MAX_PORTS];
+ long count[MAX_PORTS];
+ double* mean[MAX_PORTS];
+ double* m2[MAX_PORTS];
+ double snr[MAX_PORTS];
+ int stopped;
+} recap_average_t;
+
+// The average of the repeats of a looping source, as captured by each input. Input k's repeats start at its path latency and are period frames apart. The next frame of input k to take in is next, in repeat count[k], and each frame of the repeat keeps its running mean and its sum of squared differences from the mean, as in Welford's method, from which the noise left in the mean is worked out. stopped is set once the loop has been asked to stop.
+
+static int average_start(recap_analyser_t* analyser) {
+ recap_average_t* average = (recap_average_t*) analyser->state;
+ int k;
+ for (k = 0; k < average->inputs; k++) {
+   average->latency[k] = path_latency(average->source->port_offset, k);
+   average->next[k] = average->latency[k];
+ }
+ return 0;
+}
+
+static void average_frames(double* mean, double* m2, const float* x, long count, sf_count_t n) {
+ double scale = 1.0 / count;
+ sf_count_t i;
+ for (i = 0; i < n; i++) {
+   double delta = x[i] - mean[i];
+   mean[i] += delta * scale;
+   m2[i] += delta * (x[i] - mean[i]);
+ }
+}
+
+// Fold a run of frames of the count'th repeat into the running mean. The loop has no dependency between frames and vectorizes.
+
+static double average_snr(recap_average_t* average, int k) {
+ long count = average->count[k];
+ double signal = 0.0;
+ double noise = 0.0;
+ sf_count_t i;
+ for (i = 0; i < average->period; i++) {
+   signal += average->mean[k][i] * average->mean[k][i];
+   noise += average->m2[k][i];
+ }
+ noise /= (double) (count - 1) * count;
+ return noise > 0.0 ? 10.0 * log10(signal / noise) : INFINITY;
+}
+
+// The SNR of the mean after count repeats: the energy of the mean over the variance of the repeats, divided by count since that is what averaging does to it.
+
+static void average_stop(recap_average_t* average) {
+ int i;
+ for (i = 0; i < proc_info->reader_count; i++)
+   atomic_store(&proc_info->readers[i].loop_stop, 1);
+ average->stopped = 1;
+}
+
+static void average_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_average_t* average = (recap_average_t*) analyser->state;
+ recap_io_info_t* source = average->source;
+ sf_count_t length = SF_COUNT_MAX;
+ int k;
+ if (state_load(source->state) & RECAP_EOF(source->index))
+   length = source->frames;
+ for (k = 0; k < average->inputs; k++) {
+   sf_count_t end = frame + nframes;
+   if (length < SF_COUNT_MAX && end > average->latency[k] + length)
+     end = average->latency[k] + length;
+   while (average->next[k] < end) {
+     sf_count_t offset = (average->next[k] - average->latency[k]) % average->period;
+     sf_count_t run = average->period - offset;
+     sf_count_t skip = average->next[k] - frame;
+     if (run > end - average->next[k]) run = end - average->next[k];
+     average_frames(average->mean[k] + offset, average->m2[k] + offset, captured[k] + skip,
+                    average->count[k] + 1, run);
+     average->next[k] += run;
+     if (offset + run == average->period) {
+       average->count[k]++;
+       if (average->count[k] > 1)
+         average->snr[k] = average_snr(average, k);
+       DEBUG("average %i: %ld repeats, %.1f dB\n", k, average->count[k], average->snr[k]);
+     }
+   }
+ }
+ for (k = 0; k < average->inputs; k++) {
+   if (average->count[k] < 2 || average->snr[k] < average_snr_db) break;
+ }
+ if (k == average->inputs && !average->stopped) {
+   MSG("average: reached %.1f dB after %ld repeats, stopping the loop\n", average_snr_db, average->count[0]);
+   average_stop(average);
+ }
+}
+
+// Take in each input a repeat at a time, and once the mean of every input is within the target SNR ask the loop to stop. Nothing after the last played frame is taken in, as it arrives at each input, so the post-roll does not start a repeat of silence. Its length is known once the reader raises RECAP_EOF, which it does before the end is played. The repeats that have already been read ahead of playback are still played and averaged in.
+
+static void average_release(recap_analyser_t* analyser) {
+ recap_average_t* average = (recap_average_t*) analyser->state;
+ int k;
+ for (k = 0; k < average->inputs; k++) {
+   free(average->mean[k]);
+   free(average->m2[k]);
+ }
+ free(average);
+}
+
+static int average_finish(recap_analyser_t* analyser) {
+ recap_average_t* average = (recap_average_t*) analyser->state;
+ float* frames = (float*) calloc(average->period * average->inputs, sizeof(float));
+ SF_INFO sf_info;
+ SNDFILE* file;
+ int status = 0;
+ sf_count_t i;
+ int k;
+ for (k = 0; k < average->inputs; k++) {
+   MSG("average %i: %ld repeats, %.1f dB SNR\n", k, average->count[k], average->snr[k]);
+   if (average->count[k] == 0) status = EINVAL;
+   for (i = 0; i < average->period; i++)
+     frames[i * average->inputs + k] = (float) average->mean[k][i];
+ }
+ memset(&sf_info, 0, sizeof(sf_info));
+ sf_info.samplerate = proc_info->analysis->rate;
+ sf_info.channels = average->inputs;
+ sf_info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+ if (status) {
+   ERR("average: the capture is shorter than one repeat\n");
+ } else if ((file = sf_open(average_path, SFM_WRITE, &sf_info)) == NULL) {
+   ERR("cannot write sndfile: %s\n", average_path);
+   status = EIO;
+ } else {
+   if (sf_writef_float(file, frames, average->period) < average->period) {
+     ERR("cannot write sndfile (%s)\n", sf_strerror(file));
+     status = EIO;
+   }
+   sf_close(file);
+ }
+ free(frames);
+ average_release(analyser);
+ return status;
+}
+
+// Write the mean of the repeats of each input to average_path, one repeat long, as a float wave file.
+
+static int add_average(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_average_t* average;
+ recap_io_info_t* source = &proc_info->readers[0];
+ int k;
+ if (loop_count == 1 || source->loop_data == NULL || source->loop_fade > 0) {
+   ERR("--average needs the input looped with -l, without a crossfade\n");
+   return EINVAL;
+ }
+ if (an->captured == 0) {
+   ERR("--average needs captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "average")) == NULL)
+   return EINVAL;
+ average = (recap_average_t*) calloc(1, sizeof(recap_average_t));
+ average->source = source;
+ average->inputs = an->captured;
+ average->period = source->loop_length;
+ for (k = 0; k < average->inputs; k++) {
+   average->mean[k] = (double*) calloc(average->period, sizeof(double));
+   average->m2[k] = (double*) calloc(average->period, sizeof(double));
+ }
+ analyser->start = average_start;
+ analyser->block = average_block;
+ analyser->finish = average_finish;
+ analyser->release = average_release;
+ analyser->state = average;
+ return 0;
+}
+
+// The repeats of the infile are averaged. They must be identical, so a crossfade is not allowed.
+// Clock drift
+
+#define DRIFT_WINDOW 32768
+#define DRIFT_HISTORY 64
+
+typedef struct _recap_drift {
+ recap_fft_t* fft;
+ float* played;
+ float* captured;
+ float* re;
+ float* im;
+ double* cross_re;
+ double* cross_im;
+ int fill;
+ sf_count_t start;
+ double time[DRIFT_HISTORY];
+ double delay[DRIFT_HISTORY];
+ long estimates;
+ double drift;
+ FILE* file;
+} recap_drift_t;
+
+// Drift between the playback and capture clocks shows as a delay between the first played channel and the first input that changes steadily over time. The two are cross-correlated over windows of DRIFT_WINDOW frames, the window being filled starting at frame start, and the delay found in each is kept for the last DRIFT_HISTORY windows, along with the frame at the middle of the window. The drift is the slope of a straight line fitted through them, in frames of delay per frame.
+
+static double drift_delay(recap_drift_t* drift) {
+ int n = 2 * DRIFT_WINDOW;
+ int i, best = 0;
+ double a, b, c, bend;
+ memcpy(drift->re, drift->played, DRIFT_WINDOW * sizeof(float));
+ memcpy(drift->im, drift->captured, DRIFT_WINDOW * sizeof(float));
+ memset(drift->re + DRIFT_WINDOW, 0, DRIFT_WINDOW * sizeof(float));
+ memset(drift->im + DRIFT_WINDOW, 0, DRIFT_WINDOW * sizeof(float));
+ fft_forward(drift->fft, drift->re, drift->im);
+ for (i = 0; i <= n / 2; i++) {
+   float x[2], y[2];
+   fft_split(n, drift->re, drift->im, i, x, y);
+   drift->cross_re[i] = (double) x[0] * y[0] + (double) x[1] * y[1];
+   drift->cross_im[i] = (double) x[0] * y[1] - (double) x[1] * y[0];
+ }
+ for (i = 0; i <= n / 2; i++) {
+   drift->re[i] = (float) drift->cross_re[i];
+   drift->im[i] = (float) drift->cross_im[i];
+   if (i > 0 && i < n / 2) {
+     drift->re[n - i] = (float) drift->cross_re[i];
+     drift->im[n - i] = (float) -drift->cross_im[i];
+   }
+ }
+ fft_inverse(drift->fft, drift->re, drift->im);
+ for (i = 1; i < DRIFT_WINDOW / 2; i++) {
+   if (drift->re[i] > drift->re[best]) best = i;
+ }
+ a = drift->re[best > 0 ? best - 1 : n - 1];
+ b = drift->re[best];
+ c = drift->re[best + 1];
+ bend = a - 2.0 * b + c;
+ return best + (bend < 0.0 ? 0.5 * (a - c) / bend : 0.0);
+}
+
+// The cross-correlation of the two windows, worked out as the inverse transform of the cross spectrum. The delay is the lag of its peak, up to half a window, refined to a fraction of a frame by fitting a parabola through the peak and its neighbours.
+
+static void drift_estimate(recap_drift_t* drift) {
+ long count = drift->estimates < DRIFT_HISTORY ? drift->estimates : DRIFT_HISTORY;
+ double mean_t = 0.0, mean_d = 0.0, num = 0.0, den = 0.0;
+ long i;
+ for (i = 0; i < count; i++) {
+   mean_t += drift->time[i];
+   mean_d += drift->delay[i];
+ }
+ mean_t /= count;
+ mean_d /= count;
+ for (i = 0; i < count; i++) {
+   num += (drift->time[i] - mean_t) * (drift->delay[i] - mean_d);
+   den += (drift->time[i] - mean_t) * (drift->time[i] - mean_t);
+ }
+ if (den > 0.0) drift->drift = num / den;
+}
+
+// A least squares fit of delay against time.
+
+static void drift_window(recap_drift_t* drift, recap_analysis_t* an) {
+ double level = 0.0;
+ int slot = drift->estimates % DRIFT_HISTORY;
+ double delay, seconds;
+ int i;
+ for (i = 0; i < DRIFT_WINDOW; i++)
+   level += drift->played[i] * drift->played[i];
+ if (level < DRIFT_WINDOW * 1e-8) return;
+ delay = drift_delay(drift);
+ seconds = (drift->start + DRIFT_WINDOW / 2) / (double) an->rate;
+ drift->time[slot] = drift->start + DRIFT_WINDOW / 2;
+ drift->delay[slot] = delay;
+ drift->estimates++;
+ if (drift->estimates >= 3) {
+   drift_estimate(drift);
+   if (drift_lock)
+     atomic_store_explicit(&proc_info->drift_ppb, llround(drift->drift * 1e9), memory_order_relaxed);
+ }
+ fprintf(drift->file, "%.3f,%.4f,%.3f\n", seconds, delay, drift->drift * 1e6);
+}
+
+// A window of near silence says nothing about the delay and is skipped. With --drift-lock each new estimate is handed to the writers.
+
+static void drift_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_drift_t* drift = (recap_drift_t*) analyser->state;
+ sf_count_t done = 0;
+ while (done < nframes) {
+   sf_count_t count = DRIFT_WINDOW - drift->fill;
+   if (count > nframes - done) count = nframes - done;
+   memcpy(drift->played + drift->fill, played[0] + done, count * sizeof(float));
+   memcpy(drift->captured + drift->fill, captured[0] + done, count * sizeof(float));
+   drift->fill += count;
+   done += count;
+   if (drift->fill == DRIFT_WINDOW) {
+     drift_window(drift, proc_info->analysis);
+     drift->fill = 0;
+     drift->start += DRIFT_WINDOW;
+   }
+ }
+}
+
+static void drift_release(recap_analyser_t* analyser) {
+ recap_drift_t* drift = (recap_drift_t*) analyser->state;
+ if (drift->file) fclose(drift->file);
+ fft_free(drift->fft);
+ free(drift->played);
+ free(drift->captured);
+ free(drift->re);
+ free(drift->im);
+ free(drift->cross_re);
+ free(drift->cross_im);
+ free(drift);
+}
+
+static int drift_finish(recap_analyser_t* analyser) {
+ recap_drift_t* drift = (recap_drift_t*) analyser->state;
+ int status = 0;
+ if (fclose(drift->file)) {
+   ERR("cannot write %s: %s\n", drift_path, strerror(errno));
+   status = errno;
+ }
+ drift->file = NULL;
+ if (drift->estimates >= 3)
+   MSG("clock drift: %.3f ppm from %ld windows\n", drift->drift * 1e6, drift->estimates);
+ else
+   MSG("clock drift: too few windows to tell\n");
+ drift_release(analyser);
+ return status;
+}
+
+static int add_drift(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_drift_t* drift;
+ if (an->played == 0 || an->captured == 0) {
+   ERR("--drift needs played and captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "drift")) == NULL)
+   return EINVAL;
+ drift = (recap_drift_t*) calloc(1, sizeof(recap_drift_t));
+ if ((drift->file = fopen(drift_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", drift_path, strerror(errno));
+   free(drift);
+   return errno;
+ }
+ fprintf(drift->file, "seconds,delay,drift_ppm\n");
+ drift->fft = fft_new(2 * DRIFT_WINDOW);
+ drift->played = (float*) calloc(DRIFT_WINDOW, sizeof(float));
+ drift->captured = (float*) calloc(DRIFT_WINDOW, sizeof(float));
+ drift->re = (float*) calloc(2 * DRIFT_WINDOW, sizeof(float));
+ drift->im = (float*) calloc(2 * DRIFT_WINDOW, sizeof(float));
+ drift->cross_re = (double*) calloc(DRIFT_WINDOW + 1, sizeof(double));
+ drift->cross_im = (double*) calloc(DRIFT_WINDOW + 1, sizeof(double));
+ analyser->block = drift_block;
+ analyser->finish = drift_finish;
+ analyser->release = drift_release;
+ analyser->state = drift;
+ return 0;
+}
+
+// The timeline is written as it goes, a line per window with the time in seconds, the delay in frames and the drift so far in parts per million. The stimulus needs to be broadband for the correlation to have a clear peak.
+// Time differences of arrival
+
+#define TDOA_WINDOW 2048
+#define MAX_PAIRS 32
+
+typedef struct _recap_tdoa {
+ recap_analysis_t* analysis;
+ recap_fft_t* fft;
+ float* window;
+ int inputs;
+ int pairs;
+ int pair[MAX_PAIRS][2];
+ float* data[MAX_PORTS];
+ float* spectrum_re[MAX_PORTS];
+ float* spectrum_im[MAX_PORTS];
+ double power[MAX_PORTS];
+ float* packed_re[MAX_PORTS];
+ float* packed_im[MAX_PORTS];
+ float* re[MAX_PAIRS];
+ float* im[MAX_PAIRS];
+ double delay[MAX_PAIRS];
+ int fill;
+ sf_count_t start;
+ long windows;
+ FILE* file;
+} recap_tdoa_t;
+
+// The delay between pairs of inputs, found by generalized cross-correlation with the phase transform (GCC-PHAT) over windows of TDOA_WINDOW frames. Every input is collected into data, the window being filled starting at frame start, and transformed once per window into spectrum_re and spectrum_im, whatever the number of pairs it is in. The jobs that transform the inputs have scratch arrays of their own in packed_re and packed_im, and those that correlate the pairs in re and im, so the two stages never share one.
+
+static void tdoa_spectrum(void* arg, int j) {
+ recap_tdoa_t* tdoa = (recap_tdoa_t*) arg;
+ int n = 2 * TDOA_WINDOW;
+ int a = 2 * j;
+ int b = a + 1 < tdoa->inputs ? a + 1 : -1;
+ float* re = tdoa->packed_re[j];
+ float* im = tdoa->packed_im[j];
+ double power_a = 0.0, power_b = 0.0;
+ int i;
+ for (i = 0; i < TDOA_WINDOW; i++) {
+   re[i] = tdoa->data[a][i] * tdoa->window[i];
+   im[i] = b >= 0 ? tdoa->data[b][i] * tdoa->window[i] : 0.0f;
+   power_a += re[i] * re[i];
+   power_b += im[i] * im[i];
+ }
+ memset(re + TDOA_WINDOW, 0, TDOA_WINDOW * sizeof(float));
+ memset(im + TDOA_WINDOW, 0, TDOA_WINDOW * sizeof(float));
+ fft_forward(tdoa->fft, re, im);
+ for (i = 0; i <= n / 2; i++) {
+   float x[2], y[2];
+   fft_split(n, re, im, i, x, y);
+   tdoa->spectrum_re[a][i] = x[0];
+   tdoa->spectrum_im[a][i] = x[1];
+   if (b >= 0) {
+     tdoa->spectrum_re[b][i] = y[0];
+     tdoa->spectrum_im[b][i] = y[1];
+   }
+ }
+ tdoa->power[a] = power_a;
+ if (b >= 0) tdoa->power[b] = power_b;
+}
+
+// Inputs are transformed two at a time, zero padded to twice the window so that the correlation does not wrap around.
+
+static void tdoa_pair(void* arg, int p) {
+ recap_tdoa_t* tdoa = (recap_tdoa_t*) arg;
+ int n = 2 * TDOA_WINDOW;
+ int a = tdoa->pair[p][0];
+ int b = tdoa->pair[p][1];
+ const float* ar = tdoa->spectrum_re[a];
+ const float* ai = tdoa->spectrum_im[a];
+ const float* br = tdoa->spectrum_re[b];
+ const float* bi = tdoa->spectrum_im[b];
+ float* re = tdoa->re[p];
+ float* im = tdoa->im[p];
+ int i, lag, best = 0;
+ double left, peak, right, bend;
+ if (tdoa->power[a] < TDOA_WINDOW * 1e-10 || tdoa->power[b] < TDOA_WINDOW * 1e-10) {
+   tdoa->delay[p] = NAN;
+   return;
+ }
+ for (i = 0; i <= n / 2; i++) {
+   float cross_re = ar[i] * br[i] + ai[i] * bi[i];
+   float cross_im = ar[i] * bi[i] - ai[i] * br[i];
+   float scale = 1.0f / (sqrtf(cross_re * cross_re + cross_im * cross_im) + 1e-20f);
+   re[i] = cross_re * scale;
+   im[i] = cross_im * scale;
+ }
+ for (i = 1; i < n / 2; i++) {
+   re[n - i] = re[i];
+   im[n - i] = -im[i];
+ }
+ fft_inverse(tdoa->fft, re, im);
+ for (lag = -TDOA_WINDOW / 2 + 1; lag < TDOA_WINDOW / 2; lag++) {
+   if (re[(lag + n) % n] > re[(best + n) % n]) best = lag;
+ }
+ left = re[(best - 1 + n) % n];
+ peak = re[(best + n) % n];
+ right = re[(best + 1 + n) % n];
+ bend = left - 2.0 * peak + right;
+ tdoa->delay[p] = best + (bend < 0.0 ? 0.5 * (left - right) / bend : 0.0);
+}
+
+// The cross spectrum of the pair is divided by its magnitude, leaving only the phase, so the correlation has a sharp peak at the delay whatever the spectrum of the sound. The delay is positive when the sound reaches the second input of the pair later than the first, and is refined by a parabola through the peak and its neighbours. Pairs where either input is near silent have no delay.
+
+static void tdoa_window(recap_tdoa_t* tdoa) {
+ int p;
+ run_jobs(tdoa->analysis, tdoa_spectrum, tdoa, (tdoa->inputs + 1) / 2);
+ run_jobs(tdoa->analysis, tdoa_pair, tdoa, tdoa->pairs);
+ fprintf(tdoa->file, "%.3f", (tdoa->start + TDOA_WINDOW / 2) / (double) tdoa->analysis->rate);
+ for (p = 0; p < tdoa->pairs; p++) {
+   if (isnan(tdoa->delay[p]))
+     fprintf(tdoa->file, ",");
+   else
+     fprintf(tdoa->file, ",%.2f", tdoa->delay[p]);
+ }
+ fprintf(tdoa->file, "\n");
+ tdoa->windows++;
+}
+
+static void tdoa_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_tdoa_t* tdoa = (recap_tdoa_t*) analyser->state;
+ sf_count_t done = 0;
+ int k;
+ while (done < nframes) {
+   sf_count_t count = TDOA_WINDOW - tdoa->fill;
+   if (count > nframes - done) count = nframes - done;
+   for (k = 0; k < tdoa->inputs; k++)
+     memcpy(tdoa->data[k] + tdoa->fill, captured[k] + done, count * sizeof(float));
+   tdoa->fill += count;
+   done += count;
+   if (tdoa->fill == TDOA_WINDOW) {
+     tdoa_window(tdoa);
+     tdoa->fill = 0;
+     tdoa->start += TDOA_WINDOW;
+   }
+ }
+}
+
+// The timeline has a line per window, with the time of its middle in seconds and then the delay of each pair in frames, left empty where there is none.
+
+static void tdoa_release(recap_analyser_t* analyser) {
+ recap_tdoa_t* tdoa = (recap_tdoa_t*) analyser->state;
+ int k;
+ if (tdoa->file) fclose(tdoa->file);
+ fft_free(tdoa->fft);
+ free(tdoa->window);
+ for (k = 0; k < tdoa->inputs; k++) {
+   free(tdoa->data[k]);
+   free(tdoa->spectrum_re[k]);
+   free(tdoa->spectrum_im[k]);
+ }
+ for (k = 0; k < (tdoa->inputs + 1) / 2; k++) {
+   free(tdoa->packed_re[k]);
+   free(tdoa->packed_im[k]);
+ }
+ for (k = 0; k < tdoa->pairs; k++) {
+   free(tdoa->re[k]);
+   free(tdoa->im[k]);
+ }
+ free(tdoa);
+}
+
+static int tdoa_finish(recap_analyser_t* analyser) {
+ recap_tdoa_t* tdoa = (recap_tdoa_t*) analyser->state;
+ int status = 0;
+ if (fclose(tdoa->file)) {
+   ERR("cannot write %s: %s\n", tdoa_path, strerror(errno));
+   status = errno;
+ }
+ tdoa->file = NULL;
+ MSG("time differences: %ld windows of %i pairs\n", tdoa->windows, tdoa->pairs);
+ tdoa_release(analyser);
+ return status;
+}
+
+static int parse_pairs(recap_tdoa_t* tdoa, const char* list) {
+ const char* p = list;
+ int a, b, used;
+ if (list == NULL) {
+   for (b = 1; b < tdoa->inputs && tdoa->pairs < MAX_PAIRS; b++) {
+     tdoa->pair[tdoa->pairs][0] = 0;
+     tdoa->pair[tdoa->pairs++][1] = b;
+   }
+   return 0;
+ }
+ while (sscanf(p, "%d:%d%n", &a, &b, &used) == 2) {
+   if (a < 0 || b < 0 || a >= tdoa->inputs || b >= tdoa->inputs || a == b || tdoa->pairs == MAX_PAIRS)
+     break;
+   tdoa->pair[tdoa->pairs][0] = a;
+   tdoa->pair[tdoa->pairs++][1] = b;
+   p += used;
+   if (*p == '\0') return 0;
+   if (*p++ != ',') break;
+ }
+ ERR("pairs are given as a:b,c:d,... of %i inputs, not %s\n", tdoa->inputs, list);
+ return EINVAL;
+}
+
+// Without --tdoa-pairs the first input is paired with each of the others.
+
+static int add_tdoa(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_tdoa_t* tdoa;
+ int n = 2 * TDOA_WINDOW;
+ int i, k;
+ if (an->captured < 2) {
+   ERR("--tdoa needs at least two captured channels\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "tdoa")) == NULL)
+   return EINVAL;
+ tdoa = (recap_tdoa_t*) calloc(1, sizeof(recap_tdoa_t));
+ tdoa->analysis = an;
+ tdoa->inputs = an->captured;
+ if (parse_pairs(tdoa, tdoa_pairs)) {
+   free(tdoa);
+   return EINVAL;
+ }
+ if ((tdoa->file = fopen(tdoa_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", tdoa_path, strerror(errno));
+   free(tdoa);
+   return errno;
+ }
+ fprintf(tdoa->file, "seconds");
+ for (i = 0; i < tdoa->pairs; i++)
+   fprintf(tdoa->file, ",delay_%i_%i", tdoa->pair[i][0], tdoa->pair[i][1]);
+ fprintf(tdoa->file, "\n");
+ tdoa->fft = fft_new(n);
+ tdoa->window = (float*) calloc(TDOA_WINDOW, sizeof(float));
+ for (i = 0; i < TDOA_WINDOW; i++)
+   tdoa->window[i] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * i / TDOA_WINDOW));
+ for (k = 0; k < tdoa->inputs; k++) {
+   tdoa->data[k] = (float*) calloc(TDOA_WINDOW, sizeof(float));
+   tdoa->spectrum_re[k] = (float*) calloc(n / 2 + 1, sizeof(float));
+   tdoa->spectrum_im[k] = (float*) calloc(n / 2 + 1, sizeof(float));
+ }
+ for (k = 0; k < (tdoa->inputs + 1) / 2; k++) {
+   tdoa->packed_re[k] = (float*) calloc(n, sizeof(float));
+   tdoa->packed_im[k] = (float*) calloc(n, sizeof(float));
+ }
+ for (k = 0; k < tdoa->pairs; k++) {
+   tdoa->re[k] = (float*) calloc(n, sizeof(float));
+   tdoa->im[k] = (float*) calloc(n, sizeof(float));
+ }
+ analyser->block = tdoa_block;
+ analyser->finish = tdoa_finish;
+ analyser->release = tdoa_release;
+ analyser->state = tdoa;
+ return 0;
+}
+
+// Each window is tapered with a Hann window before it is transformed. The inputs are numbered across all captures, in the order of their ports.
+
+// Levels
+
+#define LEVEL_SECTIONS 3
+#define MAX_BANDS 32
+
+typedef struct _recap_biquad {
+ double b0, b1, b2, a1, a2;
+} recap_biquad_t;
+
+typedef struct _recap_levels_channel {
+ const float* data;
+ double band_z1[LEVEL_SECTIONS][MAX_BANDS];
+ double band_z2[LEVEL_SECTIONS][MAX_BANDS];
+ double band_energy[MAX_BANDS];
+ double a_state[3][2];
+ double c_state[2][2];
+ double k_state[2][2];
+ double a_energy;
+ double c_energy;
+ double k_energy;
+ double block_energy;
+ sf_count_t block_fill;
+ double* blocks;
+ long block_count;
+ long block_size;
+} recap_levels_channel_t;
+
+typedef struct _recap_levels {
+ recap_analysis_t* analysis;
+ int inputs;
+ int bands;
+ double centre[MAX_BANDS];
+ double band_gain[LEVEL_SECTIONS][MAX_BANDS];
+ double band_a1[LEVEL_SECTIONS][MAX_BANDS];
+ double band_a2[LEVEL_SECTIONS][MAX_BANDS];
+ recap_biquad_t a_weight[3];
+ recap_biquad_t c_weight[2];
+ recap_biquad_t k_weight[2];
+ sf_count_t interval;
+ sf_count_t block;
+ sf_count_t fill;
+ sf_count_t frame;
+ sf_count_t offset;
+ sf_count_t count;
+ recap_levels_channel_t channel[MAX_PORTS];
+ FILE* file;
+} recap_levels_t;
+
+// Levels of every input over intervals of --levels-interval seconds: the equivalent level in each third-octave band, A and C weighted, and the loudness of EBU R128, all relative to full scale. The band filters keep their coefficients and state by section and then by band, so that two neighbouring bands sit side by side and are filtered together with SSE2. The loudness is also kept in blocks of 100 ms for the integrated loudness at the end. interval, block and fill are in frames, and offset and count describe the part of the analysis block being worked on.
+
+static double biquad_run(const recap_biquad_t* q, double z[2], double x) {
+ double y = q->b0 * x + z[0];
+ z[0] = q->b1 * x - q->a1 * y + z[1];
+ z[1] = q->b2 * x - q->a2 * y;
+ return y;
+}
+
+static double complex biquad_response(const recap_biquad_t* q, double complex z) {
+ double complex w = 1.0 / z;
+ return (q->b0 + q->b1 * w + q->b2 * w * w) / (1.0 + q->a1 * w + q->a2 * w * w);
+}
+
+// A biquad in transposed direct form II, and its response at z.
+
+static void band_section(recap_biquad_t* q, double complex s, double fs) {
+ double complex z = (2.0 * fs + s) / (2.0 * fs - s);
+ q->a1 = -2.0 * creal(z);
+ q->a2 = cabs(z) * cabs(z);
+ q->b0 = 1.0;
+ q->b1 = 0.0;
+ q->b2 = -1.0;
+}
+
+static void real_poles(recap_biquad_t* q, double f1, double f2, double fs, double zero) {
+ double z1 = (2.0 * fs - 2.0 * M_PI * f1) / (2.0 * fs + 2.0 * M_PI * f1);
+ double z2 = (2.0 * fs - 2.0 * M_PI * f2) / (2.0 * fs + 2.0 * M_PI * f2);
+ q->a1 = -(z1 + z2);
+ q->a2 = z1 * z2;
+ q->b0 = 1.0;
+ q->b1 = -2.0 * zero;
+ q->b2 = 1.0;
+}
+
+// Sections from analog poles by the bilinear transform. A band section has a complex pole s and its conjugate, with zeros at 1 and -1. A weighting section has two real poles at -2πf1 and -2πf2, with a double zero at zero, 1 or -1.
+
+static void normalize(recap_biquad_t* q, int sections, double f, double fs) {
+ double complex z = cexp(I * 2.0 * M_PI * f / fs);
+ double complex h = 1.0;
+ int k;
+ for (k = 0; k < sections; k++)
+   h *= biquad_response(&q[k], z);
+ q[0].b0 /= cabs(h);
+ q[0].b1 /= cabs(h);
+ q[0].b2 /= cabs(h);
+}
+
+// Scale a cascade to a gain of 1 at frequency f.
+
+static void band_design(recap_levels_t* lv, int b, double fs) {
+ double fc = lv->centre[b];
+ double w1 = 2.0 * fs * tan(M_PI * fc * pow(10.0, -0.05) / fs);
+ double w2 = 2.0 * fs * tan(M_PI * fc * pow(10.0, 0.05) / fs);
+ double w0 = sqrt(w1 * w2);
+ double bw = w2 - w1;
+ recap_biquad_t q[LEVEL_SECTIONS];
+ int k;
+ for (k = 0; k < LEVEL_SECTIONS; k++) {
+   double complex p = cexp(I * M_PI * (2 * k + LEVEL_SECTIONS + 1) / (2.0 * LEVEL_SECTIONS));
+   double complex root = csqrt(p * p * bw * bw - 4.0 * w0 * w0);
+   double complex s = (p * bw + root) / 2.0;
+   if (cimag(s) < 0.0) s = (p * bw - root) / 2.0;
+   band_section(&q[k], s, fs);
+ }
+ normalize(q, LEVEL_SECTIONS, fc, fs);
+ for (k = 0; k < LEVEL_SECTIONS; k++) {
+   lv->band_gain[k][b] = q[k].b0;
+   lv->band_a1[k][b] = q[k].a1;
+   lv->band_a2[k][b] = q[k].a2;
+ }
+}
+
+// A sixth order Butterworth band pass between the edges of the band, as IEC 61260 asks of a class 1 filter. Each pole p of the low pass prototype becomes a pair of band pass poles, the roots of s² - pBs + ω0², and the one above the real axis makes a section with its conjugate. The zeros are at 1 and -1, so each section is a gain times 1 - z⁻², which the band loop relies on.
+
+static void weighting_design(recap_levels_t* lv, double fs) {
+ static const double f1 = 20.598997, f2 = 107.65265, f3 = 737.86223, f4 = 12194.217;
+ double k = tan(M_PI * 1681.974450955533 / fs);
+ double q = 0.7071752369554196;
+ double vh = pow(10.0, 3.999843853973347 / 20.0);
+ double vb = pow(vh, 0.4996667741545416);
+ double a0 = 1.0 + k / q + k * k;
+ real_poles(&lv->a_weight[0], f1, f1, fs, 1.0);
+ real_poles(&lv->a_weight[1], f4, f4, fs, -1.0);
+ real_poles(&lv->a_weight[2], f2, f3, fs, 1.0);
+ normalize(lv->a_weight, 3, 1000.0, fs);
+ real_poles(&lv->c_weight[0], f1, f1, fs, 1.0);
+ real_poles(&lv->c_weight[1], f4, f4, fs, -1.0);
+ normalize(lv->c_weight, 2, 1000.0, fs);
+ lv->k_weight[0] = (recap_biquad_t) { (vh + vb * k / q + k * k) / a0, 2.0 * (k * k - vh) / a0,
+                                      (vh - vb * k / q + k * k) / a0, 2.0 * (k * k - 1.0) / a0,
+                                      (1.0 - k / q + k * k) / a0 };
+ k = tan(M_PI * 38.13547087602444 / fs);
+ q = 0.5003270373238773;
+ a0 = 1.0 + k / q + k * k;
+ lv->k_weight[1] = (recap_biquad_t) { 1.0, -2.0, 1.0, 2.0 * (k * k - 1.0) / a0, (1.0 - k / q + k * k) / a0 };
+}
+
+// A and C weighting from the poles of IEC 61672, with 0 dB at 1 kHz. The bilinear transform is not prewarped, so A and C fall off a little early close to the Nyquist frequency. The K weighting of ITU-R BS.1770, a high shelf and a high pass, is designed for the sample rate from the parameters its 48 kHz coefficients come from.
+
+static void levels_job(void* arg, int j) {
+ recap_levels_t* lv = (recap_levels_t*) arg;
+ recap_levels_channel_t* ch = &lv->channel[j];
+ const float* data = ch->data + lv->offset;
+ int bands = lv->bands;
+ sf_count_t i;
+ int s, b;
+ for (i = 0; i < lv->count; i++) {
+   double x = data[i];
+   double a, c, k;
+   b = 0;
+#if defined(__x86_64__)
+   for (; b + 2 <= bands; b += 2) {
+     __m128d y = _mm_set1_pd(x);
+     for (s = 0; s < LEVEL_SECTIONS; s++) {
+       double* z1 = ch->band_z1[s] + b;
+       double* z2 = ch->band_z2[s] + b;
+       __m128d in = _mm_mul_pd(_mm_loadu_pd(lv->band_gain[s] + b), y);
+       y = _mm_add_pd(in, _mm_loadu_pd(z1));
+       _mm_storeu_pd(z1, _mm_sub_pd(_mm_loadu_pd(z2), _mm_mul_pd(_mm_loadu_pd(lv->band_a1[s] + b), y)));
+       _mm_storeu_pd(z2, _mm_sub_pd(_mm_sub_pd(_mm_setzero_pd(), in), _mm_mul_pd(_mm_loadu_pd(lv->band_a2[s] + b), y)));
+     }
+     _mm_storeu_pd(ch->band_energy + b, _mm_add_pd(_mm_loadu_pd(ch->band_energy + b), _mm_mul_pd(y, y)));
+   }
+#endif
+   for (; b < bands; b++) {
+     double y = x;
+     for (s = 0; s < LEVEL_SECTIONS; s++) {
+       double in = lv->band_gain[s][b] * y;
+       y = in + ch->band_z1[s][b];
+       ch->band_z1[s][b] = ch->band_z2[s][b] - lv->band_a1[s][b] * y;
+       ch->band_z2[s][b] = -in - lv->band_a2[s][b] * y;
+     }
+     ch->band_energy[b] += y * y;
+   }
+   a = biquad_run(&lv->a_weight[0], ch->a_state[0], x);
+   a = biquad_run(&lv->a_weight[1], ch->a_state[1], a);
+   a = biquad_run(&lv->a_weight[2], ch->a_state[2], a);
+   c = biquad_run(&lv->c_weight[0], ch->c_state[0], x);
+   c = biquad_run(&lv->c_weight[1], ch->c_state[1], c);
+   k = biquad_run(&lv->k_weight[0], ch->k_state[0], x);
+   k = biquad_run(&lv->k_weight[1], ch->k_state[1], k);
+   ch->a_energy += a * a;
+   ch->c_energy += c * c;
+   ch->k_energy += k * k;
+   ch->block_energy += k * k;
+   if (++ch->block_fill == lv->block) {
+     if (ch->block_count == ch->block_size) {
+       ch->block_size = ch->block_size ? 2 * ch->block_size : 1024;
+       ch->blocks = (double*) realloc(ch->blocks, ch->block_size * sizeof(double));
+     }
+     ch->blocks[ch->block_count++] = ch->block_energy / lv->block;
+     ch->block_energy = 0.0;
+     ch->block_fill = 0;
+   }
+ }
+}
+
+// Every input is filtered on its own, so the inputs are shared out among the analysis threads.
+
+static double lufs(double energy) {
+ return energy > 0.0 ? -0.691 + 10.0 * log10(energy) : -INFINITY;
+}
+
+static void levels_record(recap_levels_t* lv, sf_count_t frames) {
+ double seconds = (lv->frame + frames) / (double) lv->analysis->rate;
+ int j, b;
+ for (j = 0; j < lv->inputs; j++) {
+   recap_levels_channel_t* ch = &lv->channel[j];
+   fprintf(lv->file, "%.3f,%i,%.2f,%.2f,%.2f", seconds, j,
+           db(sqrt(ch->a_energy / frames)), db(sqrt(ch->c_energy / frames)), lufs(ch->k_energy / frames));
+   for (b = 0; b < lv->bands; b++) {
+     fprintf(lv->file, ",%.2f", db(sqrt(ch->band_energy[b] / frames)));
+     ch->band_energy[b] = 0.0;
+   }
+   fprintf(lv->file, "\n");
+   ch->a_energy = ch->c_energy = ch->k_energy = 0.0;
+ }
+}
+
+// A record per input at the end of each interval, with the time of its end.
+
+static void levels_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_levels_t* lv = (recap_levels_t*) analyser->state;
+ sf_count_t done = 0;
+ int j;
+ for (j = 0; j < lv->inputs; j++)
+   lv->channel[j].data = captured[j];
+ while (done < nframes) {
+   lv->offset = done;
+   lv->count = lv->interval - lv->fill;
+   if (lv->count > nframes - done) lv->count = nframes - done;
+   run_jobs(lv->analysis, levels_job, lv, lv->inputs);
+   lv->fill += lv->count;
+   done += lv->count;
+   if (lv->fill == lv->interval) {
+     levels_record(lv, lv->fill);
+     lv->frame += lv->fill;
+     lv->fill = 0;
+   }
+ }
+}
+
+// Blocks are cut at the ends of intervals, so every input has been filtered up to the end of an interval before its record is written.
+
+static double integrated_loudness(recap_levels_channel_t* ch) {
+ double sum = 0.0, gate;
+ long n = 0, i;
+ int pass;
+ gate = 1e-7 / pow(10.0, -0.0691);
+ for (pass = 0; pass < 2; pass++) {
+   sum = 0.0;
+   n = 0;
+   for (i = 0; i + 4 <= ch->block_count; i++) {
+     double energy = 0.25 * (ch->blocks[i] + ch->blocks[i + 1] + ch->blocks[i + 2] + ch->blocks[i + 3]);
+     if (energy > gate) {
+       sum += energy;
+       n++;
+     }
+   }
+   if (n == 0) return -INFINITY;
+   if (pass == 0 && gate < sum / n * 0.1) gate = sum / n * 0.1;
+ }
+ return lufs(sum / n);
+}
+
+// The integrated loudness of EBU R128 over gating blocks of 400 ms, overlapping by 75%. Blocks below -70 LUFS are left out, then those more than 10 LU below the loudness of the rest.
+
+static void levels_release(recap_analyser_t* analyser) {
+ recap_levels_t* lv = (recap_levels_t*) analyser->state;
+ int j;
+ if (lv->file) fclose(lv->file);
+ for (j = 0; j < lv->inputs; j++)
+   free(lv->channel[j].blocks);
+ free(lv);
+}
+
+static int levels_finish(recap_analyser_t* analyser) {
+ recap_levels_t* lv = (recap_levels_t*) analyser->state;
+ int status = 0;
+ int j;
+ if (lv->fill > 0) levels_record(lv, lv->fill);
+ if (fclose(lv->file)) {
+   ERR("cannot write %s: %s\n", levels_path, strerror(errno));
+   status = errno;
+ }
+ lv->file = NULL;
+ for (j = 0; j < lv->inputs; j++)
+   MSG("input %i: integrated loudness %.1f LUFS\n", j, integrated_loudness(&lv->channel[j]));
+ levels_release(analyser);
+ return status;
+}
+
+// The last interval is written even if it is short.
+
+static int levels_start(recap_analyser_t* analyser) {
+ recap_levels_t* lv = (recap_levels_t*) analyser->state;
+ double fs = lv->analysis->rate;
+ int k, b;
+ lv->interval = (sf_count_t) llround(levels_interval * fs);
+ lv->block = (sf_count_t) llround(0.1 * fs);
+ if (lv->interval < 1) lv->interval = 1;
+ for (k = -16; k <= 13 && lv->bands < MAX_BANDS; k++) {
+   double fc = 1000.0 * pow(10.0, k / 10.0);
+   if (fc * pow(10.0, 0.05) < 0.45 * fs) lv->centre[lv->bands++] = fc;
+ }
+ for (b = 0; b < lv->bands; b++)
+   band_design(lv, b, fs);
+ weighting_design(lv, fs);
+ fprintf(lv->file, "seconds,input,LAeq,LCeq,LUFS");
+ for (b = 0; b < lv->bands; b++)
+   fprintf(lv->file, ",%.4g", lv->centre[b]);
+ fprintf(lv->file, "\n");
+ return 0;
+}
+
+// The third-octave bands have the base ten centre frequencies of IEC 61260 from 25 Hz to 20 kHz, as many as fit below the Nyquist frequency with room to spare. The filters are designed once the sample rate is known.
+
+static int add_levels(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_levels_t* lv;
+ if (an->captured == 0 || levels_interval <= 0.0) {
+   ERR("--levels needs captured channels and an interval above 0\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "levels")) == NULL)
+   return EINVAL;
+ lv = (recap_levels_t*) calloc(1, sizeof(recap_levels_t));
+ if ((lv->file = fopen(levels_path, "w")) == NULL) {
+   ERR("cannot open %s: %s\n", levels_path, strerror(errno));
+   free(lv);
+   return errno;
+ }
+ lv->analysis = an;
+ lv->inputs = an->captured;
+ analyser->start = levels_start;
+ analyser->block = levels_block;
+ analyser->finish = levels_finish;
+ analyser->release = levels_release;
+ analyser->state = lv;
+ return 0;
+}
+
+// Together with --no-audio this keeps a record of the levels of a long capture in a few hundred bytes a second.
+
+// Live spectrum
+
+#define SPECTRUM_FFT 1024
+#define SPECTRUM_NICE 19
+
+typedef struct _recap_spectrum_shm {
+ char magic[8];
+ uint32_t channels;
+ uint32_t bins;
+ double rate;
+ atomic_uint sequence;
+ uint32_t reserved;
+ uint64_t frame;
+ float magnitude[];
+} recap_spectrum_shm_t;
+
+// The shared memory segment a viewer maps. magic is "RECAPSPC", rate is the sample rate after decimation, so that bin k is at k * rate / (2 * (bins - 1)) Hz, and magnitude holds bins levels in dB relative to full scale for each channel in turn, frame being the last decimated frame they cover. sequence is a seqlock: it is odd while a snapshot is being written, and a reader copies the spectra and keeps the copy if sequence was even before and unchanged after.
+
+typedef struct _recap_spectrum {
+ recap_analysis_t* analysis;
+ int inputs;
+ int factor;
+ int phase;
+ recap_biquad_t filter[2];
+ double state[MAX_PORTS][2][2];
+ float* decimated;
+ size_t frame_size;
+ jack_ringbuffer_t* ring;
+ long dropped;
+ pthread_t thread_id;
+ pthread_mutex_t lock;
+ pthread_cond_t cond;
+ int stop;
+ recap_fft_t* fft;
+ float* window;
+ float* history[MAX_PORTS];
+ float* re;
+ float* im;
+ float* magnitude;
+ int fill;
+ uint64_t frame;
+ recap_spectrum_shm_t* shm;
+ size_t shm_size;
+} recap_spectrum_t;
+
+// The analysis thread low pass filters and decimates every input by --spectrum-decimate and hands the frames to the spectrum thread through ring, leaving them out, and counting them in dropped, when the spectrum thread has fallen behind. A display can miss a few frames, so unlike the other analysers this never holds up the analysis. The spectrum thread keeps the last SPECTRUM_FFT decimated frames of each input in history.
+
+static void spectrum_publish(recap_spectrum_t* sp) {
+ recap_spectrum_shm_t* shm = sp->shm;
+ unsigned sequence = atomic_load_explicit(&shm->sequence, memory_order_relaxed);
+ atomic_store_explicit(&shm->sequence, sequence + 1, memory_order_relaxed);
+ atomic_thread_fence(memory_order_release);
+ memcpy(shm->magnitude, sp->magnitude, sp->inputs * shm->bins * sizeof(float));
+ shm->frame = sp->frame;
+ atomic_store_explicit(&shm->sequence, sequence + 2, memory_order_release);
+}
+
+// The fence keeps the stores to the spectra from being seen before sequence turns odd.
+
+static void spectrum_snapshot(recap_spectrum_t* sp) {
+ int bins = SPECTRUM_FFT / 2 + 1;
+ float scale = 0.0f;
+ int i, k;
+ for (i = 0; i < SPECTRUM_FFT; i++)
+   scale += sp->window[i];
+ scale = 2.0f / scale;
+ for (k = 0; k < sp->inputs; k++) {
+   float* magnitude = sp->magnitude + k * bins;
+   for (i = 0; i < SPECTRUM_FFT; i++) {
+     sp->re[i] = sp->history[k][i] * sp->window[i];
+     sp->im[i] = 0.0f;
+   }
+   fft_forward(sp->fft, sp->re, sp->im);
+   for (i = 0; i < bins; i++)
+     magnitude[i] = (float) db(scale * sqrtf(sp->re[i] * sp->re[i] + sp->im[i] * sp->im[i]) + 1e-10f);
+ }
+ spectrum_publish(sp);
+}
+
+// A Hann windowed spectrum of each input, scaled so that a full scale sine reads 0 dB.
+
+static void* spectrum_thread(void* arg) {
+ recap_spectrum_t* sp = (recap_spectrum_t*) arg;
+ float frame[MAX_PORTS];
+ int hop = SPECTRUM_FFT / 2;
+ int k;
+ setpriority(PRIO_PROCESS, 0, SPECTRUM_NICE);
+ pthread_mutex_lock(&sp->lock);
+ while (1) {
+   if (jack_ringbuffer_read_space(sp->ring) < sp->frame_size) {
+     if (sp->stop) break;
+     pthread_cond_wait(&sp->cond, &sp->lock);
+     continue;
+   }
+   pthread_mutex_unlock(&sp->lock);
+   while (jack_ringbuffer_read_space(sp->ring) >= sp->frame_size) {
+     jack_ringbuffer_read(sp->ring, (char*) frame, sp->frame_size);
+     for (k = 0; k < sp->inputs; k++)
+       sp->history[k][sp->fill] = frame[k];
+     sp->frame++;
+     if (++sp->fill == SPECTRUM_FFT) {
+       spectrum_snapshot(sp);
+       for (k = 0; k < sp->inputs; k++)
+         memmove(sp->history[k], sp->history[k] + hop, hop * sizeof(float));
+       sp->fill = hop;
+     }
+   }
+   pthread_mutex_lock(&sp->lock);
+ }
+ pthread_mutex_unlock(&sp->lock);
+ return NULL;
+}
+
+// A new snapshot every half transform. On Linux setpriority() with 0 lowers the priority of the calling thread only, so the spectrum thread gives way to the IO workers and the analysis thread, which keep their priority.
+
+static void spectrum_block(recap_analyser_t* analyser, float** played, float** captured, sf_count_t frame, sf_count_t nframes) {
+ recap_spectrum_t* sp = (recap_spectrum_t*) analyser->state;
+ size_t count = 0;
+ sf_count_t i;
+ int k;
+ for (i = 0; i < nframes; i++) {
+   for (k = 0; k < sp->inputs; k++) {
+     double x = captured[k][i];
+     if (sp->factor > 1) {
+       x = biquad_run(&sp->filter[0], sp->state[k][0], x);
+       x = biquad_run(&sp->filter[1], sp->state[k][1], x);
+     }
+     sp->decimated[count * sp->inputs + k] = (float) x;
+   }
+   if (++sp->phase == sp->factor) {
+     sp->phase = 0;
+     count++;
+   }
+ }
+ if (count == 0) return;
+ if (jack_ringbuffer_write_space(sp->ring) < count * sp->frame_size)
+   sp->dropped += count;
+ else
+   jack_ringbuffer_write(sp->ring, (char*) sp->decimated, count * sp->frame_size);
+ if (pthread_mutex_trylock(&sp->lock) == 0) {
+   pthread_cond_signal(&sp->cond);
+   pthread_mutex_unlock(&sp->lock);
+ }
+}
+
+// Every frame is filtered, and every factor'th one kept; the slot of a frame that is not kept is written over by the next one.
+
+static int spectrum_start(recap_analyser_t* analyser) {
+ recap_spectrum_t* sp = (recap_spectrum_t*) analyser->state;
+ double rate = sp->analysis->rate;
+ int bins = SPECTRUM_FFT / 2 + 1;
+ int fd, i;
+ sp->shm_size = sizeof(recap_spectrum_shm_t) + sp->inputs * bins * sizeof(float);
+ if ((fd = shm_open(spectrum_name, O_CREAT | O_RDWR, 0644)) < 0 || ftruncate(fd, sp->shm_size) ||
+     (sp->shm = (recap_spectrum_shm_t*) mmap(NULL, sp->shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+   int error = errno;
+   ERR("cannot map shared memory %s: %s\n", spectrum_name, strerror(error));
+   if (fd >= 0) close(fd);
+   sp->shm = NULL;
+   return error;
+ }
+ close(fd);
+ memset(sp->shm, 0, sp->shm_size);
+ memcpy(sp->shm->magic, "RECAPSPC", 8);
+ sp->shm->channels = sp->inputs;
+ sp->shm->bins = bins;
+ sp->shm->rate = rate / sp->factor;
+ atomic_init(&sp->shm->sequence, 0);
+ for (i = 0; i < 2; i++) {
+   static const double q[2] = { 0.54119610, 1.3065630 };
+   double w = 2.0 * M_PI * 0.4 / sp->factor;
+   double alpha = sin(w) / (2.0 * q[i]);
+   double a0 = 1.0 + alpha;
+   sp->filter[i] = (recap_biquad_t) { 0.5 * (1.0 - cos(w)) / a0, (1.0 - cos(w)) / a0, 0.5 * (1.0 - cos(w)) / a0,
+                                      -2.0 * cos(w) / a0, (1.0 - alpha) / a0 };
+ }
+ pthread_create(&sp->thread_id, NULL, spectrum_thread, sp);
+ return 0;
+}
+
+// The decimation filter is a fourth order Butterworth low pass at 80% of the new Nyquist frequency.
+
+static void spectrum_release(recap_analyser_t* analyser) {
+ recap_spectrum_t* sp = (recap_spectrum_t*) analyser->state;
+ int k;
+ if (sp->thread_id) {
+   pthread_mutex_lock(&sp->lock);
+   sp->stop = 1;
+   pthread_cond_signal(&sp->cond);
+   pthread_mutex_unlock(&sp->lock);
+   pthread_join(sp->thread_id, NULL);
+ }
+ if (sp->shm) munmap(sp->shm, sp->shm_size);
+ jack_ringbuffer_free(sp->ring);
+ fft_free(sp->fft);
+ free(sp->window);
+ free(sp->decimated);
+ free(sp->re);
+ free(sp->im);
+ free(sp->magnitude);
+ for (k = 0; k < sp->inputs; k++)
+   free(sp->history[k]);
+ pthread_mutex_destroy(&sp->lock);
+ pthread_cond_destroy(&sp->cond);
+ free(sp);
+}
+
+static int spectrum_finish(recap_analyser_t* analyser) {
+ recap_spectrum_t* sp = (recap_spectrum_t*) analyser->state;
+ if (sp->dropped > 0)
+   MSG("spectrum display missed %ld frames\n", sp->dropped);
+ spectrum_release(analyser);
+ return 0;
+}
+
+// The spectrum thread is stopped once it has emptied the ring. The segment itself is removed at the end of main(), which is also reached after a signal.
+
+static int add_spectrum(recap_analysis_t* an) {
+ recap_analyser_t* analyser;
+ recap_spectrum_t* sp;
+ int bins = SPECTRUM_FFT / 2 + 1;
+ int i, k;
+ if (an->captured == 0 || spectrum_decimate < 1) {
+   ERR("--spectrum needs captured channels and a decimation of at least 1\n");
+   return EINVAL;
+ }
+ if ((analyser = add_analyser(an, "spectrum")) == NULL)
+   return EINVAL;
+ sp = (recap_spectrum_t*) calloc(1, sizeof(recap_spectrum_t));
+ sp->analysis = an;
+ sp->inputs = an->captured;
+ sp->factor = spectrum_decimate;
+ sp->frame_size = sp->inputs * sizeof(float);
+ sp->ring = jack_ringbuffer_create((ring_size / sp->factor + ANALYSIS_BLOCK) * sp->frame_size);
+ sp->decimated = (float*) calloc(ANALYSIS_BLOCK + 1, sp->frame_size);
+ pthread_mutex_init(&sp->lock, NULL);
+ pthread_cond_init(&sp->cond, NULL);
+ sp->fft = fft_new(SPECTRUM_FFT);
+ sp->window = (float*) calloc(SPECTRUM_FFT, sizeof(float));
+ for (i = 0; i < SPECTRUM_FFT; i++)
+   sp->window[i] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * i / SPECTRUM_FFT));
+ sp->re = (float*) calloc(SPECTRUM_FFT, sizeof(float));
+ sp->im = (float*) calloc(SPECTRUM_FFT, sizeof(float));
+ sp->magnitude = (float*) calloc(sp->inputs * bins, sizeof(float));
+ for (k = 0; k < sp->inputs; k++)
+   sp->history[k] = (float*) calloc(SPECTRUM_FFT, sizeof(float));
+ analyser->start = spectrum_start;
+ analyser->block = spectrum_block;
+ analyser->finish = spectrum_finish;
+ analyser->release = spectrum_release;
+ analyser->state = sp;
+ return 0;
+}
+
+// The ring holds as many frames as the analysis ring, decimated, and a whole analysis block besides. When the analysis thread has a backlog it hands over blocks back to back, and the spectrum thread may not run until it is through. A viewer needs nothing from jack: it maps the segment named by --spectrum read only and polls it.
+
+// Main jack callback
+
+static jack_nframes_t play_tone(recap_io_info_t* reader, recap_sample_t** out, jack_nframes_t nframes) {
+ recap_tone_t* tone = reader->tone;
+ int wanted = atomic_load_explicit(&tone->wanted, memory_order_acquire);
+ jack_nframes_t i;
+ int c;
+ if (wanted >= tone->steps) {
+   reader->played_out = 1;
+   recap_mute(out, reader->channels, 0, nframes);
+   return 0;
+ }
+ if (wanted != tone->step) {
+   tone->step = wanted;
+   tone->increment = 2.0 * M_PI * tone_frequency(tone, wanted) / tone->rate;
+   tone->start[wanted] = reader->played;
+   atomic_store_explicit(&tone->started, wanted + 1, memory_order_release);
+ }
+ for (i = 0; i < nframes; i++) {
+   float value = (float) (SWEEP_LEVEL * sin(tone->phase));
+   for (c = 0; c < reader->channels; c++)
+     out[c][i] = value;
+   tone->phase += tone->increment;
+   if (tone->phase >= 2.0 * M_PI) tone->phase -= 2.0 * M_PI;
+ }
+ reader->played += nframes;
+ return nframes;
+}
+
+// A stepped sine source plays its current tone for as long as the analysis wants it. When the analysis asks for the next step, the tone changes frequency at the start of the next cycle without a jump in phase, and the frame it changed on is published for the analysis. Once every step has been asked for the source has played out.
+
+static jack_nframes_t play_source(recap_process_info_t* info, recap_io_info_t* reader,
+                                  recap_sample_t** out, unsigned word, jack_nframes_t nframes) {
+ jack_nframes_t avail = jack_ringbuffer_read_space(reader->ring) / reader->frame_size;
+ jack_nframes_t frames = nframes;
+ if (word & RECAP_EOF(reader->index)) {
+   sf_count_t left = reader->frames - reader->played;
+   if (left <= nframes) {
+     frames = left;
+     reader->played_out = 1;
+   }
+ }
+ if (avail < frames) {
+   ++info->underruns;
+   ERR("control thread: buffer underrun (%s)\n", reader->path);
+   frames = avail;
+ }
+ uninterleave(out, reader->channels, frames, &next_value, reader->ring);
+ recap_mute(out, reader->channels, frames, nframes);
+ reader->played += frames;
+ return frames;
+}
+
+// This, the guts of the processing is simply uninterleaving the file data and writing it to the buffers of the appropriate output ports. Jack handles the rest. Once the reader has published the length of its file, the last period is played up to the exact final frame and the rest of it is zero filled. Only a ring that runs dry before then is an underrun. Returns the number of frames played.
+
+static int process(jack_nframes_t nframes, void* arg) {
+ recap_process_info_t* info = (recap_process_info_t*) arg;
+ recap_state_t* state = info->state;
+
+// The main jack callback. This function must read nframes of signal from the connected input ports and write nframes of signal to the connected output ports. The size of nframes is determined by the caller (jack).
+
+ unsigned word = state_load(state);
+ recap_status_t phase = word & RECAP_PHASE;
+ if (phase < RUNNING)
+   return 0;
+
+// No point reading or writing anything to jack?s buffers if everything isn?t ready to go. This is the only load of the shared state per cycle; it must happen before the ring levels are looked at so that data written before RECAP_EOF was raised is seen.
+
+ recap_sample_t* in[MAX_PORTS];
+ recap_sample_t* out[MAX_PORTS];
+ int i = 0;
+ jack_port_t* prt;
+ while ((prt = recap_in_ports[i]) != NULL) {
+   in[i++] = (recap_sample_t*) jack_port_get_buffer(prt, nframes);
+ }
+ in[i] = NULL;
+
+ i = 0;
+ while ((prt = recap_out_ports[i]) != NULL) {
+   out[i++] = (recap_sample_t*) jack_port_get_buffer(prt, nframes);
+ }
+ out[i] = NULL;
+
+// Get the signal buffers of each input and output port. It is recommended in the jack documentation that these are not cached.
+
+ if (phase != RUNNING || info->played_out) {
+   recap_mute(out, channel_count_r, 0, nframes);
+ }
+ if (phase == RUNNING) {
+
+// Once playback has finished the outputs are simply muted until the writer has drained the capture ring.
+
+   jack_nframes_t captured = 0;
+   if (!info->played_out) {
+     int playing = 0;
+     for (i = 0; i < info->reader_count; i++) {
+       recap_io_info_t* reader = &info->readers[i];
+       recap_sample_t** reader_out = out + reader->port_offset;
+       if (reader->played_out) {
+         recap_mute(reader_out, reader->channels, 0, nframes);
+         continue;
+       }
+       jack_nframes_t frames = reader->tone ? play_tone(reader, reader_out, nframes)
+                                            : play_source(info, reader, reader_out, word, nframes);
+       if (!reader->played_out) {
+         captured = nframes;
+         playing = 1;
+       } else if (frames > captured) {
+         captured = frames;
+       }
+     }
+     if (!playing) {
+       info->played_out = 1;
+       info->postroll_left = info->postroll;
+     }
+   }
+
+// Every file is played to its own ports, and files which have finished are muted while the others carry on. Stepped sines are made here rather than read. Capture runs up to the last frame of the longest file.
+
+   if (info->played_out) {
+     jack_nframes_t tail = nframes - captured;
+     if (tail > info->postroll_left) tail = info->postroll_left;
+     captured += tail;
+     info->postroll_left -= tail;
+   }
+
+// After the last frame has been played the outputs stay muted while capture carries on for the post-roll, so that room decay and system latency are recorded without padding the input file with silence.
+
+   if (captured > 0 && info->captured >= info->next_stamp)
+     record_stamp(info);
+   for (i = 0; i < info->sink_count; i++) {
+     recap_io_info_t* writer = &info->writers[i];
+     if (interleave(in + writer->port_offset, writer->channels, captured, &write_value, writer->ring)) {
+       ++info->overruns;
+       ERR("control thread: buffer overrun (%s)\n", writer->path);
+     }
+   }
+   if (info->analysis && captured > 0)
+     tap_frames(info->analysis, in, out, captured);
+   info->captured += captured;
+   if (info->played_out && info->postroll_left == 0) {
+     state_advance(state, RUNNING, DRAINING);
+     if (info->sink_count == 0) state_advance(state, DRAINING, DONE);
+   }
+ }
+
+// Similarly simple. Interleaving the input port data and writing each group of ports to its writer thread?s ringbuffer, and passing the played and captured frames on for analysis. Capture stops on the exact frame the post-roll runs out (the same frame as playback when there is none), so the output is exactly as long as the input plus the post-roll, and the session moves on to DRAINING. With --no-audio there is no writer to drain, and it goes straight on to DONE.
+
+ for (i = 0; i < info->reader_count; i++) {
+   if (reader_wants_wake(&info->readers[i]))
+     wake_stream(info, &info->readers[i]);
+ }
+ for (i = 0; i < info->sink_count; i++) {
+   if (writer_wants_wake(&info->writers[i]))
+     wake_stream(info, &info->writers[i]);
+ }
+ if (info->analysis)
+   wake_analysis(info->analysis, phase);
+ return 0;
+}
+
+// Data has been written to the writer thread?s ringbuffer and removed from the reader thread?s ringbuffer, so signal each thread to begin another iteration once enough work has built up for it.
+// Thread setup and running
+
+static int sink_format(const char* path) {
+ static const struct { const char* ext; int format; } formats[] = {
+   { "wav", SF_FORMAT_WAV | SF_FORMAT_PCM_32 },
+   { "w64", SF_FORMAT_W64 | SF_FORMAT_PCM_32 },
+   { "rf64", SF_FORMAT_RF64 | SF_FORMAT_PCM_32 },
+   { "aif", SF_FORMAT_AIFF | SF_FORMAT_PCM_32 },
+   { "aiff", SF_FORMAT_AIFF | SF_FORMAT_PCM_32 },
+   { "caf", SF_FORMAT_CAF | SF_FORMAT_PCM_32 },
+   { "flac", SF_FORMAT_FLAC | SF_FORMAT_PCM_24 },
+   { "ogg", SF_FORMAT_OGG | SF_FORMAT_VORBIS },
+   { "oga", SF_FORMAT_OGG | SF_FORMAT_VORBIS }
+ };
+ const char* ext = strrchr(path, '.');
+ size_t i;
+ for (i = 0; ext != NULL && i < sizeof(formats) / sizeof(formats[0]); i++) {
+   if (strcasecmp(ext + 1, formats[i].ext) == 0) return formats[i].format;
+ }
+ return SF_FORMAT_WAV | SF_FORMAT_PCM_32;
+}
+
+// The format of a capture file follows its extension, with the best resolution each format holds, and anything else is a 32 bit WAV file as before.
+
+static int setup_writer_thread(recap_io_info_t* info) {
+ int status = 0;
+ int jack_rate = jack_get_sample_rate(client);
+ if (info->channels == 0) {
+   ERR("no input ports to capture %s from\n", info->path);
+   return EINVAL;
+ }
+ if (info->rate == 0) info->rate = jack_rate;
+ info->port_offset = channel_count_w;
+ channel_count_w += info->channels;
+ if (channel_count_w > MAX_PORTS - 1) {
+   ERR("too many input channels (%i)\n", channel_count_w);
+   return EINVAL;
+ }
+ if (no_audio) return 0;
+ info->frame_size = info->channels * sample_size;
+ info->format = sink_format(info->path);
+ if (rotate_secs > 0) {
+   info->base_path = info->path;
+   info->segment_frames = (sf_count_t) rotate_secs * info->rate;
+   segment_name(info);
+ }
+ DEBUG("writing %i channels at %i Hz\n", info->channels, info->rate);
+ if (info->rate != jack_rate || drift_lock)
+   info->resampler = resampler_new(info->channels, (double) jack_rate / info->rate);
+ info->stamps = (recap_stamps_t*) aligned_alloc(CACHE_LINE, sizeof(recap_stamps_t));
+ memset(info->stamps, 0, sizeof(recap_stamps_t));
+ if ((status = open_sink(info)) != 0)
+   return status;
+ info->ring = jack_ringbuffer_create(sample_size * ring_size);
+ memset(info->ring->buf, 0, info->ring->size);
+ info->wake_space = wake_threshold(info->ring, info->frame_size);
+ info->ops = &writer_ops;
+ return 0;
+}
+
+// Set up resources for a writer. This means opening a (multichannel) sound file to write to, creating a ringbuffer, and touching all its allocated memory to prevent pagefaults later on. The file's channels are captured from the next free input ports, and a capture without any is refused. The timestamp table is allocated and touched in the same way before the output file and its sidecars are opened, and the ring only once they are. With --no-audio a writer only takes its ports.
+
+static int decoder_threads(SF_INFO* sf_info) {
+ int major = sf_info->format & SF_FORMAT_TYPEMASK;
+ int threads = decode_threads;
+ if (threads < 0) {
+   if (major != SF_FORMAT_FLAC && major != SF_FORMAT_OGG) return 0;
+   threads = sysconf(_SC_NPROCESSORS_ONLN);
+   if (threads > 4) threads = 4;
+ }
+ if (threads > MAX_DECODERS) threads = MAX_DECODERS;
+ if (!sf_info->seekable || sf_info->frames <= 0 || sf_info->frames == SF_COUNT_MAX) return 0;
+ return threads;
+}
+
+// Compressed files are decoded in parallel by default, on up to four threads. -D sets the number of threads for every input file, or turns parallel decoding off with 0. A file that cannot be seeked, or whose length is unknown, is always read straight through.
+
+static int preload(recap_io_info_t* info, SF_INFO* sf_info) {
+ size_t size = sf_info->frames * info->channels * sizeof(float);
+ if (sf_info->frames <= 0 || (info->loop_data = (float*) malloc(size)) == NULL) {
+   ERR("cannot load sndfile into memory: %s\n", info->path);
+   return EIO;
+ }
+ info->loop_length = sf_readf_float(info->file, info->loop_data, sf_info->frames);
+ if (info->loop_length < sf_info->frames) {
+   ERR("cannot read sndfile: %s\n", info->path);
+   return EIO;
+ }
+ info->loop_fade = (sf_count_t) crossfade_ms * sf_info->samplerate / 1000;
+ if (info->loop_fade > info->loop_length / 2) info->loop_fade = info->loop_length / 2;
+ DEBUG("loaded %lld frames to loop\n", (long long) info->loop_length);
+ return 0;
+}
+
+// With -l the whole input file is read into memory before playback starts, so the disk only sees capture writes however long the loop runs. The crossfade is at most half the file.
+
+static int tone_thread_fn(recap_io_info_t* info) {
+ reader_primed(info, proc_info->reader_count);
+ state_raise(info->state, RECAP_EOF(info->index));
+ return FINISHED;
+}
+
+static const recap_stream_ops_t tone_ops = {
+ &tone_thread_fn, &reader_ready, &reader_urgency, &io_cleanup
+};
+
+static int setup_tone(recap_io_info_t* info) {
+ recap_tone_t* tone = (recap_tone_t*) calloc(1, sizeof(recap_tone_t));
+ char tail;
+ info->tone = tone;
+ if (sscanf(info->path, "steps:%lf:%lf:%i%c", &tone->low, &tone->high, &tone->steps, &tail) != 3 ||
+     tone->low <= 0.0 || tone->high < tone->low || tone->steps < 1 || tone->steps > MAX_STEPS) {
+   ERR("stepped sines are given as steps:low:high:count, up to %i steps, not %s\n", MAX_STEPS, info->path);
+   return EINVAL;
+ }
+ if (stepped_path == NULL) {
+   ERR("a steps source only moves on with --stepped\n");
+   return EINVAL;
+ }
+ tone->rate = jack_get_sample_rate(client);
+ tone->step = -1;
+ atomic_init(&tone->started, 0);
+ atomic_init(&tone->wanted, 0);
+ info->channels = array_length(info->port_names);
+ if (info->channels == 0) {
+   ERR("a generated source needs output ports: %s\n", info->path);
+   return EINVAL;
+ }
+ info->frame_size = info->channels * sample_size;
+ info->port_offset = channel_count_r;
+ channel_count_r += info->channels;
+ if (channel_count_r > MAX_PORTS - 1) {
+   ERR("too many output channels (%i)\n", channel_count_r);
+   return EINVAL;
+ }
+ info->ring = jack_ringbuffer_create(info->frame_size);
+ info->wake_space = 0;
+ info->ops = &tone_ops;
+ DEBUG("stepping %i tones from %g to %g Hz\n", tone->steps, tone->low, tone->high);
+ return 0;
+}
+
+// A source named steps:low:high:count plays count sine tones, spaced evenly in log frequency from low to high Hz, on all its ports. The tones are made by the jack thread, so the stream has nothing to read: it marks itself primed and finished straight away, and its ring is only there for the worker pool to look at.
+
+static int setup_sweep(recap_io_info_t* info) {
+ recap_sweep_t* sweep = (recap_sweep_t*) calloc(1, sizeof(recap_sweep_t));
+ sf_count_t ir_frames;
+ int status;
+ int c;
+ info->sweep = sweep;
+ if ((status = parse_sweep(info->path, sweep)) != 0) return status;
+ sweep->rate = jack_get_sample_rate(client);
+ sweep->length = (sf_count_t) (sweep->secs * sweep->rate);
+ ir_frames = (sf_count_t) (mesm_ir_secs * sweep->rate);
+ if (sweep->noise) {
+   sweep->tail = (sf_count_t) (NOISE_GAP * sweep->rate);
+   sweep->stagger = sweep->length + sweep->tail;
+ } else {
+   sweep->stagger = ir_frames + (sf_count_t) ceil(sweep->length * log(MESM_ORDER) / log(sweep->high / sweep->low));
+   sweep->tail = ir_frames;
+ }
+ info->channels = array_length(info->port_names);
+ if (info->channels == 0) {
+   ERR("a generated source needs output ports: %s\n", info->path);
+   return EINVAL;
+ }
+ info->frame_size = info->channels * sample_size;
+ info->port_offset = channel_count_r;
+ channel_count_r += info->channels;
+ if (channel_count_r > MAX_PORTS - 1) {
+   ERR("too many output channels (%i)\n", channel_count_r);
+   return EINVAL;
+ }
+ info->loop_length = sweep->length + (info->channels - 1) * sweep->stagger + sweep->tail;
+ info->loop_data = (float*) calloc(info->loop_length * info->channels, sizeof(float));
+ for (c = 0; c < info->channels; c++)
+   render_sweep(sweep, info->loop_data + c * sweep->stagger * info->channels + c, info->channels);
+ DEBUG("generating %i channels, %lld frames apart, for %lld frames\n", info->channels,
+       (long long) sweep->stagger, (long long) info->loop_length);
+ info->ring = jack_ringbuffer_create(sample_size * ring_size);
+ memset(info->ring->buf, 0, info->ring->size);
+ info->wake_space = wake_threshold(info->ring, info->frame_size);
+ info->ops = &reader_ops;
+ return 0;
+}
+
+// A source named sweep:low:high:secs is generated instead of read, with one channel for each port it is played to, and played from memory like a looping file. Each channel plays the same sweep, stagger frames after the channel before, for multiple exponential sweep measurement. The stagger is the impulse response length given by --mesm-ir plus the time by which the sweep runs ahead of itself at MESM_ORDER times the frequency, so that none of the first MESM_ORDER - 1 harmonic responses of one channel overlaps the impulse response of the channel before it. The last channel is followed by one impulse response length of silence. A source named noise:secs plays secs of noise on each channel in turn, with NOISE_GAP seconds of silence after each, for the crosstalk measurement.
+static int setup_reader_thread(recap_io_info_t* info) {
+ int status = 0;
+ SF_INFO sf_info;
+ sf_info.format = 0;
+ if (strncmp(info->path, "sweep:", 6) == 0 || strncmp(info->path, "noise:", 6) == 0)
+   return setup_sweep(info);
+ if (strncmp(info->path, "steps:", 6) == 0)
+   return setup_tone(info);
+ DEBUG("opened to read: %s\n", info->path);
+ if ((info->file = sf_open(info->path, SFM_READ, &sf_info)) == NULL) {
+   ERR("cannot read sndfile: %s\n", info->path);
+   return EIO;
+ }
+ info->channels = sf_info.channels;
+ info->frame_size = info->channels * sample_size;
+ info->port_offset = channel_count_r;
+ channel_count_r += info->channels;
+ if (channel_count_r > MAX_PORTS - 1) {
+   ERR("too many output channels (%i)\n", channel_count_r);
+   sf_close(info->file);
+   return EINVAL;
+ }
+ DEBUG("reading %i channels\n", info->channels);
+ if (sf_info.samplerate != 44100) {
+   ERR("jack sample rate must be 44100 (is %i)\n", sf_info.samplerate);
+   cancel_process(proc_info);
+ }
+ int threads = decoder_threads(&sf_info);
+ if (loop_count != 1) {
+   if ((status = preload(info, &sf_info)) != 0) {
+     sf_close(info->file);
+     return status;
+   }
+ } else if (threads > 0) {
+   DEBUG("decoding on %i threads\n", threads);
+   if ((info->decoder = decoder_new(info, sf_info.frames, threads)) == NULL) {
+     sf_close(info->file);
+     return EIO;
+   }
+ }
+ info->ring = jack_ringbuffer_create(sample_size * ring_size);
+ memset(info->ring->buf, 0, info->ring->size);
+ info->wake_space = wake_threshold(info->ring, info->frame_size);
+ info->ops = &reader_ops;
+ return status;
+}
+
+// Same purpose as the previous function but for a reader. Opens a (multichannel) WAV file to read from, creates a ringbuffer, and touches all its memory. The file's channels are given the next free output ports. A compressed file gets a decoder, which starts decoding straight away.
+
+// Similarites between these two functions could probably be extracted into a general setup_io_thread() function.
+
+static void start_workers(recap_process_info_t* info) {
+ int streams = stream_count(info);
+ int count = io_workers > 0 ? io_workers : sysconf(_SC_NPROCESSORS_ONLN);
+ int i;
+ if (count > streams) count = streams;
+ if (count < 1) count = 1;
+ info->worker_count = count;
+ atomic_init(&info->streams_left, streams);
+ for (i = 0; i < streams; i++)
+   stream_at(info, i)->home = i % count;
+ for (i = 0; i < count; i++) {
+   recap_worker_t* worker = &info->workers[i];
+   memset(worker, 0, sizeof(*worker));
+   pthread_mutex_init(&worker->lock, NULL);
+   pthread_cond_init(&worker->cond, NULL);
+   worker->index = i;
+ }
+ for (i = 0; i < count; i++)
+   pthread_create(&info->workers[i].thread_id, NULL, worker_thread, &info->workers[i]);
+}
+
+// Start the IO workers once every stream is set up, and share the streams out among them as their homes. The readers start filling their rings straight away.
+
+static int join_workers(recap_process_info_t* info) {
+ int status = 0;
+ int i;
+ for (i = 0; i < info->worker_count; i++) {
+   void* ret;
+   pthread_join(info->workers[i].thread_id, &ret);
+   if (ret == PTHREAD_CANCELED) status = EPIPE;
+ }
+ for (i = 0; i < stream_count(info); i++)
+   status |= stream_at(info, i)->status;
+ return status;
+}
+
+// Joins to the workers and returns the exit status of the streams.
+
+// Port registration and connection
+
+static jack_port_t* register_port(char* name, int flags) {
+  jack_port_t* port;
+  if ((port = jack_port_register(client, name, JACK_DEFAULT_AUDIO_TYPE, flags, 0)) == 0) {
+    DEBUG("cannot register port \"%s\"\n", name);
+    jack_client_close(client);
+    exit(1);
+  }
+  return port;
+}
+
+// Register the named port with the jack process. 
+
+static void connect(const char* out, const char* in) {
+ if (jack_connect(client, out, in)) {
+   DEBUG("cannot connect port \"%s\" to \"%s\"\n", out, in);
+   jack_client_close(client);
+   exit(1);
+ }
+}
+
+static void connect_ports(recap_process_info_t* info) {
+ int i;
+ char* s;
+ int w;
+ for (w = 0; w < info->writer_count; w++) {
+   recap_io_info_t* writer = &info->writers[w];
+   int k;
+   for (k = 0; k < writer->channels; k++) {
+     char prt[32];
+     i = writer->port_offset + k;
+     sprintf(prt, "recapture:input_%i", i);
+     char* shrt = prt + strlen("recapture:");
+     register_port(shrt, JackPortIsInput);
+     recap_in_ports[i] = jack_port_by_name(client, prt);
+     if ((s = writer->port_names[k]) != NULL) connect(s, prt);
+   }
+ }
+ recap_in_ports[channel_count_w] = NULL;
+ int r;
+ for (r = 0; r < info->reader_count; r++) {
+   recap_io_info_t* reader = &info->readers[r];
+   int k;
+   for (k = 0; k < reader->channels; k++) {
+     char prt[32];
+     i = reader->port_offset + k;
+     sprintf(prt, "recapture:output_%i", i);
+     char* shrt = prt + strlen("recapture:");
+     register_port(shrt, JackPortIsOutput);
+     recap_out_ports[i] = jack_port_by_name(client, prt);
+     if ((s = reader->port_names[k]) != NULL) connect(prt, s);
+   }
+ }
+ recap_out_ports[channel_count_r] = NULL;
+}
+
+// Initialize recap_in_ports and recap_out_ports with this client?s in and out ports, and connect them to the supplied jack ports. The ports are numbered consecutively across all the files being played or captured.
+// Set callbacks and handlers
+
+static void set_handlers(jack_client_t* client, recap_process_info_t* info) {
+ jack_set_process_callback(client, process, info);
+ jack_on_shutdown(client, jack_shutdown, info);
+ signal(SIGQUIT, signal_handler);
+ signal(SIGTERM, signal_handler);
+ signal(SIGHUP, signal_handler);
+ signal(SIGINT, signal_handler);
+}
+
+// Set jack callbacks and signal handlers.
+// Run jack client
+
+static jack_nframes_t port_latency(jack_port_t** ports, jack_latency_callback_mode_t mode) {
+ jack_nframes_t latency = 0;
+ jack_latency_range_t range;
+ int i;
+ for (i = 0; ports[i] != NULL; i++) {
+   jack_port_get_latency_range(ports[i], mode, &range);
+   if (range.max > latency) latency = range.max;
+ }
+ return latency;
+}
+
+static jack_nframes_t postroll_frames(jack_client_t* client) {
+ jack_nframes_t frames = (jack_nframes_t) ((long long) postroll_ms * jack_get_sample_rate(client) / 1000);
+ if (postroll_latency) {
+   frames += port_latency(recap_out_ports, JackPlaybackLatency);
+   frames += port_latency(recap_in_ports, JackCaptureLatency);
+ }
+ return frames;
+}
+
+// The post-roll in frames. With -L the worst case playback latency of the output ports plus capture latency of the input ports is added, as reported by jack once the ports are connected, so the tail is long enough to include the round trip through the hardware.
+
+static int run_client(jack_client_t* client, recap_process_info_t* info) {
+ recap_state_t* state = info->state;
+
+ info->postroll = postroll_frames(client);
+ if (info->postroll > 0)
+   DEBUG("post-roll of %u frames\n", info->postroll);
+ info->stamp_interval = (jack_nframes_t) ((long long) stamp_ms * jack_get_sample_rate(client) / 1000);
+ if (info->analysis)
+   info->analysis->rate = jack_get_sample_rate(client);
+ if (info->analysis && start_analysis(info->analysis))
+   cancel_process(info);
+
+ while (state_phase(state) < PREFILLED)
+   usleep(1000);
+ state_advance(state, PREFILLED, RUNNING);
+
+ int io_status = join_workers(info);
+ int other_status = 0;
+ int i;
+ if (info->analysis && info->analysis->thread_id) {
+   void* ret;
+   pthread_join(info->analysis->thread_id, &ret);
+   other_status = ret == PTHREAD_CANCELED ? EPIPE : info->analysis->status;
+   if (null_discard && other_status == 0 && io_status == 0) {
+     for (i = 0; i < info->sink_count; i++)
+       discard_capture(&info->writers[i]);
+   }
+ }
+
+ if (info->overruns > 0) {
+   ERR("recapture failed with %ld overruns.\n", info->overruns);
+   ERR("try a bigger buffer than -b %" PRIu32 ".\n", ring_size);
+   other_status = EPIPE;
+ }
+ long underruns = total_underruns(info);
+ if (underruns > 0) {
+   ERR("recapture failed with %ld underruns.\n", underruns);
+   ERR("try a bigger buffer than -b %" PRIu32 ".\n", ring_size);
+   other_status = EPIPE;
+ }
+ if (info->stamps_dropped > 0)
+   MSG("%ld timestamps dropped, try a longer interval than -T %ld\n",
+       info->stamps_dropped, stamp_ms);
+ for (i = 0; i < info->worker_count; i++) {
+   recap_worker_t* worker = &info->workers[i];
+   if (spin_usecs > 0)
+     MSG("worker %i: %ld spin hits, %ld parks\n", i, worker->spin_hits, worker->parks);
+   if (worker->steals > 0)
+     DEBUG("worker %i served %ld times for another worker\n", i, worker->steals);
+ }
+ return io_status || other_status;
+}
+
+// Start the analysis, wait for the readers to prefill their playback rings, start playing and capturing, then wait for the IO workers and the analysis and return their status. An analysis that was cancelled never finished, and fails like a cancelled worker. When spinning is enabled, report how often it paid off.
+
+// The readers are primed whatever the outcome of their first read, and a signal moves the session straight to DONE, so the wait cannot hang.
+// Checksum verification
+
+typedef struct _recap_verify_info {
+ char** paths;
+ int count;
+ atomic_int next;
+ atomic_int failed;
+} recap_verify_info_t;
+
+static int verify_file(const char* path) {
+ char crc_path[PATH_MAX];
+ FILE* crc_file;
+ long long block;
+ int channels;
+ SF_INFO sf_info;
+ SNDFILE* file;
+ int status = 0;
+ snprintf(crc_path, sizeof(crc_path), "%s.crc32c", path);
+ if ((crc_file = fopen(crc_path, "r")) == NULL) {
+   ERR("%s: cannot open checksums (%s)\n", path, strerror(errno));
+   return EIO;
+ }
+ if (fscanf(crc_file, "# crc32c block=%lld channels=%i sample=int32\n", &block, &channels) != 2 ||
+     block <= 0 || channels <= 0) {
+   ERR("%s: not a recapture checksum file\n", crc_path);
+   fclose(crc_file);
+   return EINVAL;
+ }
+ sf_info.format = 0;
+ if ((file = sf_open(path, SFM_READ, &sf_info)) == NULL) {
+   ERR("%s: cannot read sndfile (%s)\n", path, sf_strerror(NULL));
+   fclose(crc_file);
+   return EIO;
+ }
+ if (sf_info.channels != channels) {
+   ERR("%s: has %i channels, checksums are for %i\n", path, sf_info.channels, channels);
+   status = EINVAL;
+ }
+ size_t frame_size = channels * sizeof(int32_t);
+ int32_t* buf = (int32_t*) malloc(block * frame_size);
+ long index;
+ long long frames;
+ uint32_t expected;
+ while (!status && fscanf(crc_file, "%ld %lld %" SCNx32 "\n", &index, &frames, &expected) == 3) {
+   if (frames > block || sf_readf_int(file, buf, frames) < frames) {
+     ERR("%s: block %ld is short\n", path, index);
+     status = EIO;
+   } else if (~crc32c(~0U, buf, frames * frame_size) != expected) {
+     ERR("%s: block %ld (frames %lld to %lld) does not match\n",
+         path, index, (long long) index * block, (long long) index * block + frames);
+     status = EIO;
+   }
+ }
+ if (!status && !feof(crc_file)) {
+   ERR("%s: cannot parse %s\n", path, crc_path);
+   status = EINVAL;
+ }
+ if (!status && sf_readf_int(file, buf, 1) > 0) {
+   ERR("%s: has frames beyond its checksums\n", path);
+   status = EIO;
+ }
+ if (!status) MSG("%s: OK\n", path);
+ free(buf);
+ sf_close(file);
+ fclose(crc_file);
+ return status;
+}
+
+// Check one file against its sidecar. The samples are read back as integers, which for 32 bit PCM are exactly the integers the writer checksummed.
+
+static void* verify_thread(void* arg) {
+ recap_verify_info_t* info = (recap_verify_info_t*) arg;
+ int i;
+ while ((i = atomic_fetch_add(&info->next, 1)) < info->count) {
+   if (verify_file(info->paths[i]))
+     atomic_fetch_add(&info->failed, 1);
+ }
+ return NULL;
+}
+
+static int verify_files(int count, char** paths) {
+ recap_verify_info_t info;
+ pthread_t threads[64];
+ int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+ int i;
+ if (nthreads > count) nthreads = count;
+ if (nthreads > 64) nthreads = 64;
+ if (nthreads < 1) nthreads = 1;
+ info.paths = paths;
+ info.count = count;
+ atomic_init(&info.next, 0);
+ atomic_init(&info.failed, 0);
+ crc32c_init();
+ for (i = 0; i < nthreads; i++)
+   pthread_create(&threads[i], NULL, verify_thread, &info);
+ for (i = 0; i < nthreads; i++)
+   pthread_join(threads[i], NULL);
+ if (atomic_load(&info.failed) > 0) {
+   ERR("%i of %i files failed verification\n", atomic_load(&info.failed), count);
+   return 1;
+ }
+ return 0;
+}
+
+// recapture --verify checks any number of files in parallel, one thread per core each taking the next unchecked file, and exits non zero if any of them fails.
+// Argument parsing
+
+static void split_names(char* str, char** list) {
+ int i = 0;
+ char* s = strtok(str, ",");
+ while (s != NULL) {
    list[i++] = s;
    s = strtok(NULL, ",");
  }
@@ -624,13 +5154,78 @@ static void split_names(char* str, char** list) {
 
 // Port names given on the commandline are comma separated.
 
-static void parse_arguments(int argc, char** argv, char** in_names, char** out_names) {
- char* optstring = "b:i:o:h";
+static int add_stream(char* arg, char** paths, char* names[][MAX_PORTS], int* count, int max) {
+ char* ports = strchr(arg, '=');
+ if (ports == NULL || ports == arg || *count >= max) return 1;
+ *ports++ = '\0';
+ paths[*count] = arg;
+ split_names(ports, names[*count]);
+ ++*count;
+ return 0;
+}
+
+// A source or capture is given as file=ports. Slot 0 is left for the infile or outfile named after the options.
+
+static int sink_rate(char* path) {
+ char* at = strrchr(path, '@');
+ char* end;
+ if (at == NULL) return 0;
+ long rate = strtol(at + 1, &end, 10);
+ if (*end != '\0' || rate <= 0) return 0;
+ *at = '\0';
+ return (int) rate;
+}
+
+// A capture file may end in @rate, to be written at that sample rate instead of jack's.
+
+static int verify = 0;
+
+static void parse_arguments(int argc, char** argv, char* in_names[][MAX_PORTS], char* out_names[][MAX_PORTS],
+                            char** sink_paths, int* sink_count, char** source_paths, int* source_count) {
+ char* optstring = "b:w:S:j:D:A:l:F:R:N:p:LT:BC:X:i:o:s:c:h";
  struct option long_options[] = {
    { "help", 0, 0, 'h' },
    { "bufsize", 1, 0, 'b' },
+   { "wakeup", 1, 0, 'w' },
+   { "spin", 1, 0, 'S' },
+   { "workers", 1, 0, 'j' },
+   { "decoders", 1, 0, 'D' },
+   { "analysers", 1, 0, 'A' },
+   { "loop", 1, 0, 'l' },
+   { "crossfade", 1, 0, 'F' },
+   { "rotate", 1, 0, 'R' },
+   { "null", 1, 0, 'N' },
+   { "null-latency", 1, 0, 256 },
+   { "null-discard", 0, 0, 257 },
+   { "welch", 1, 0, 258 },
+   { "welch-size", 1, 0, 259 },
+   { "mesm", 1, 0, 260 },
+   { "mesm-ir", 1, 0, 261 },
+   { "crosstalk", 1, 0, 262 },
+   { "stepped", 1, 0, 263 },
+   { "average", 1, 0, 264 },
+   { "snr", 1, 0, 265 },
+   { "thd", 1, 0, 266 },
+   { "drift", 1, 0, 267 },
+   { "drift-lock", 0, 0, 268 },
+   { "tdoa", 1, 0, 269 },
+   { "tdoa-pairs", 1, 0, 270 },
+   { "no-audio", 0, 0, 271 },
+   { "levels", 1, 0, 272 },
+   { "levels-interval", 1, 0, 273 },
+   { "spectrum", 1, 0, 274 },
+   { "spectrum-decimate", 1, 0, 275 },
+   { "postroll", 1, 0, 'p' },
+   { "postroll-latency", 0, 0, 'L' },
+   { "timestamps", 1, 0, 'T' },
+   { "bwf", 0, 0, 'B' },
+   { "crc", 1, 0, 'C' },
+   { "index", 1, 0, 'X' },
+   { "verify", 0, 0, 'V' },
    { "inports", 1, 0, 'i' },
    { "outports", 1, 0, 'o' },
+   { "source", 1, 0, 's' },
+   { "capture", 1, 0, 'c' },
    { 0, 0, 0, 0 }
  };
 
@@ -650,11 +5245,130 @@ static void parse_arguments(int argc, char** argv, char** in_names, char** out_n
    case 'b':
      ring_size = atoi(optarg);
      break;
+   case 'w':
+     wake_percent = atoi(optarg);
+     if (wake_percent < 1 || wake_percent > 100) show_usage = 1;
+     break;
+   case 'S':
+     spin_usecs = atol(optarg);
+     break;
+   case 'j':
+     io_workers = atoi(optarg);
+     if (io_workers < 1) show_usage = 1;
+     break;
+   case 'D':
+     decode_threads = atoi(optarg);
+     if (decode_threads < 0) show_usage = 1;
+     break;
+   case 'l':
+     loop_count = atol(optarg);
+     if (loop_count < 0) show_usage = 1;
+     break;
+   case 'F':
+     crossfade_ms = atol(optarg);
+     break;
+   case 'R':
+     rotate_secs = atol(optarg);
+     break;
+   case 'N':
+     null_test = 1;
+     null_db = atof(optarg);
+     break;
+   case 256:
+     null_latency = atol(optarg);
+     break;
+   case 257:
+     null_discard = 1;
+     break;
+   case 258:
+     welch_path = optarg;
+     break;
+   case 259:
+     welch_size = atoi(optarg);
+     break;
+   case 260:
+     mesm_path = optarg;
+     break;
+   case 261:
+     mesm_ir_secs = atof(optarg);
+     break;
+   case 262:
+     crosstalk_path = optarg;
+     break;
+   case 263:
+     stepped_path = optarg;
+     break;
+   case 264:
+     average_path = optarg;
+     break;
+   case 265:
+     average_snr_db = atof(optarg);
+     break;
+   case 266:
+     thd_path = optarg;
+     break;
+   case 267:
+     drift_path = optarg;
+     break;
+   case 268:
+     drift_lock = 1;
+     break;
+   case 269:
+     tdoa_path = optarg;
+     break;
+   case 270:
+     tdoa_pairs = optarg;
+     break;
+   case 271:
+     no_audio = 1;
+     break;
+   case 272:
+     levels_path = optarg;
+     break;
+   case 273:
+     levels_interval = atof(optarg);
+     break;
+   case 274:
+     spectrum_name = optarg;
+     break;
+   case 275:
+     spectrum_decimate = atoi(optarg);
+     break;
+   case 'A':
+     analysis_threads = atoi(optarg);
+     break;
+   case 'p':
+     postroll_ms = atol(optarg);
+     break;
+   case 'L':
+     postroll_latency = 1;
+     break;
+   case 'T':
+     stamp_ms = atol(optarg);
+     break;
+   case 'B':
+     bwf = 1;
+     break;
+   case 'C':
+     crc_block = atoll(optarg);
+     break;
+   case 'X':
+     index_secs = atol(optarg);
+     break;
+   case 'V':
+     verify = 1;
+     break;
    case 'i':
-     split_names(optarg, in_names);
+     split_names(optarg, in_names[0]);
      break;
    case 'o':
-     split_names(optarg, out_names);
+     split_names(optarg, out_names[0]);
+     break;
+   case 's':
+     if (add_stream(optarg, source_paths, out_names, source_count, MAX_SOURCES)) show_usage = 1;
+     break;
+   case 'c':
+     if (add_stream(optarg, sink_paths, in_names, sink_count, MAX_SINKS)) show_usage = 1;
      break;
    default:
      show_usage = 1;
@@ -662,7 +5376,11 @@ static void parse_arguments(int argc, char** argv, char** in_names, char** out_n
    }
  }
 
- if (show_usage == 1 || argc - optind < 2) {
+ if (drift_lock && drift_path == NULL) {
+   ERR("--drift-lock needs --drift\n");
+   show_usage = 1;
+ }
+ if (show_usage == 1 || argc - optind < (verify || no_audio ? 1 : 2)) {
    MSG("%s", usage);
    exit(1);
  }
@@ -671,42 +5389,68 @@ static void parse_arguments(int argc, char** argv, char** in_names, char** out_n
 // Straightforward argument handling.
 // main
 
+static void io_init(recap_io_info_t* info, int index, recap_state_t* state) {
+ memset(info, 0, sizeof(*info));
+ atomic_init(&info->claimed, 0);
+ atomic_init(&info->cleaned, 0);
+ atomic_init(&info->loop_stop, 0);
+ info->index = index;
+ info->state = state;
+}
+
+// Streams start out unclaimed.
+
 int main(int argc, char** argv) {
  recap_process_info_t info;
- recap_io_info_t reader_info;
- recap_io_info_t writer_info;
+ recap_io_info_t readers[MAX_SOURCES];
+ recap_io_info_t writers[MAX_SINKS];
+ recap_worker_t workers[MAX_SOURCES + MAX_SINKS];
  recap_state_t state;
  memset(&info, 0, sizeof(info));
- memset(&reader_info, 0, sizeof(reader_info));
- memset(&writer_info, 0, sizeof(writer_info));
  memset(&state, 0, sizeof(state));
- info.reader_info = &reader_info;
- info.writer_info = &writer_info;
+ info.readers = readers;
+ info.writers = writers;
+ info.workers = workers;
  info.state = &state;
- reader_info.state = &state;
- writer_info.state = &state;
- state.can_play = 0;
- state.reading = IDLE;
- state.playing = IDLE;
+ atomic_init(&state.word, IDLE);
+ atomic_init(&info.drift_ppb, 0);
  proc_info = &info;
 
 // Initialize info instances and touch their memory to prevent pagefaults.
 
- char* in_port_names[MAX_PORTS];
- char* out_port_names[MAX_PORTS];
- parse_arguments(argc, argv, in_port_names, out_port_names);
-
- proc_info->reader_info->path = argv[optind];
- proc_info->writer_info->path = argv[++optind];
-
-// Port names and file paths.
-
- channel_count_w = array_length(in_port_names);
- frame_size_w = channel_count_w * sample_size;
+ char* in_port_names[MAX_SINKS][MAX_PORTS] = { { NULL } };
+ char* out_port_names[MAX_SOURCES][MAX_PORTS] = { { NULL } };
+ char* sink_paths[MAX_SINKS] = { NULL };
+ char* source_paths[MAX_SOURCES] = { NULL };
+ int sink_count = 1;
+ int source_count = 1;
+ parse_arguments(argc, argv, in_port_names, out_port_names,
+                 sink_paths, &sink_count, source_paths, &source_count);
+ if (verify) return verify_files(argc - optind, argv + optind);
+ crc32c_init();
+
+ source_paths[0] = argv[optind];
+ sink_paths[0] = optind + 1 < argc ? argv[optind + 1] : "-";
+ int i;
+ for (i = 0; i < source_count; i++) {
+   io_init(&readers[i], i, &state);
+   readers[i].path = source_paths[i];
+   readers[i].port_names = out_port_names[i];
+ }
+ info.reader_count = source_count;
+ for (i = 0; i < sink_count; i++) {
+   io_init(&writers[i], i, &state);
+   writers[i].rate = sink_rate(sink_paths[i]);
+   writers[i].path = sink_paths[i];
+   writers[i].port_names = in_port_names[i];
+   writers[i].channels = array_length(in_port_names[i]);
+ }
+ info.writer_count = sink_count;
+ info.sink_count = no_audio ? 0 : sink_count;
 
-// Writer thread channel count and frame size. Those for the reader thread are taken from the input file in setup_reader_thread().
+// Port names and file paths. infile is always source 0 and outfile capture 0. The channel count of each capture is the number of ports given for it; those for the reader threads are taken from the input files in setup_reader_thread().
 
- DEBUG("%s\n", proc_info->reader_info->path);
+ DEBUG("%s\n", source_paths[0]);
  if ((client = jack_client_open("recapture", JackNullOption, NULL)) == 0) {
    ERR("jack server not running?\n");
    exit(1);
@@ -717,23 +5461,55 @@ int main(int argc, char** argv) {
 // Connect to jack and set up jack and signal callbacks.
 
  int status = 0;
- if (!(status = setup_writer_thread(proc_info->writer_info)) &&
-     !(status = setup_reader_thread(proc_info->reader_info))) {
+ for (i = 0; i < sink_count && !status; i++)
+   status = setup_writer_thread(&writers[i]);
+ for (i = 0; i < source_count && !status; i++)
+   status = setup_reader_thread(&readers[i]);
+ if (!status && (null_test || welch_path || mesm_path || thd_path || drift_path || tdoa_path || levels_path || spectrum_name || crosstalk_path || stepped_path || average_path))
+   info.analysis = analysis_new(&state);
+ if (!status && null_test)
+   status = add_null_test(info.analysis);
+ if (!status && welch_path)
+   status = add_welch(info.analysis);
+ if (!status && (mesm_path || thd_path))
+   status = add_mesm(info.analysis);
+ if (!status && crosstalk_path)
+   status = add_crosstalk(info.analysis);
+ if (!status && stepped_path)
+   status = add_stepped(info.analysis);
+ if (!status && average_path)
+   status = add_average(info.analysis);
+ if (!status && drift_path)
+   status = add_drift(info.analysis);
+ if (!status && tdoa_path)
+   status = add_tdoa(info.analysis);
+ if (!status && levels_path)
+   status = add_levels(info.analysis);
+ if (!status && spectrum_name)
+   status = add_spectrum(info.analysis);
+ if (!status) {
+   start_workers(proc_info);
    if (jack_activate(client)) {
      ERR("cannot activate client\n");
      status = 1;
    } else {
-     connect_ports(in_port_names, out_port_names);
+     connect_ports(proc_info);
      DEBUG("connected ports\n");
      status = run_client(client, proc_info);
-     jack_client_close(client);
    }
  }
-
-// Provided the IO threads execute ok, run this client and then close it once run_client() returns.
-
- io_free(proc_info->reader_info);
- io_free(proc_info->writer_info);
+ for (i = 0; i < sink_count; i++)
+   if (writers[i].file) close_sink(&writers[i]);
+ jack_client_close(client);
+
+// Provided the IO threads execute ok, and the analysis is set up when asked for, run this client and then close it once run_client() returns, or once setup has failed. The writers close their files as they finish, so any still open are those of a setup that failed part way, and they are closed here to complete their headers and sidecars.
+
+ for (i = 0; i < source_count; i++)
+   io_free(&readers[i]);
+ for (i = 0; i < sink_count; i++)
+   io_free(&writers[i]);
+ analysis_free(info.analysis);
+ if (spectrum_name) shm_unlink(spectrum_name);
  return status;
 }
 